@@ -4,6 +4,7 @@ use strict;
 use v5.10;
 use Data::Dumper;
 use Mine::Utils::IP qw(cidr2long host2long splitbycidr);
+use Mine::Utils::IPTrie;
 use base Mine::Config::;
 
 =head1 NAME
@@ -22,6 +23,15 @@ to prevent deep recursion.
 
 our $ACTION_MAX_RECURSION_LEVEL = 10;
 
+=head2 $MATCH_CACHE_SIZE = 10000
+
+Package variable describing maximum number of (sender, user, event) combinations
+which results of match() are cached. Cache is cleared when it is exceeded.
+
+=cut
+
+our $MATCH_CACHE_SIZE = 10000;
+
 =head2 new([$cfgpath])
 
 Same as Mine::Config::new(), but in addition tryes to validate config if specified.
@@ -167,6 +177,8 @@ Returned config form will be:
 		actions => [act1, ..., actn] # actions that have no conditions
 	}
 
+In addition compiles matcher used by match() and stores it in $self->{matcher}
+
 =cut
 
 sub load_optimized {
@@ -180,6 +192,9 @@ sub load_optimized {
 		actions => [],
 	};
 	
+	my @rules;
+	my $trie = Mine::Utils::IPTrie->new();
+	
 	foreach my $entry (@{$self->{data}}) {
 		next unless exists $entry->{action};
 		
@@ -194,6 +209,7 @@ sub load_optimized {
 		}
 		
 		my $action = {action => $entry->{action}, condcnt => $conditions};
+		push @rules, [$action, exists $entry->{sender}, exists $entry->{user}, exists $entry->{event}];
 		
 		if (exists $entry->{sender}) {
 			foreach my $elt (@{$entry->{sender}}) {
@@ -203,6 +219,7 @@ sub load_optimized {
 						$net  = host2long($net);
 						$cidr = cidr2long($cidr);
 						push @{$cfg->{netmask}}, $net, $cidr, $action;
+						$trie->add($net, $cidr, $action);
 					}
 					else {
 						$elt = host2long($elt);
@@ -223,7 +240,53 @@ sub load_optimized {
 		}
 	}
 	
+	$self->{matcher} = {rules => \@rules, trie => $trie, cache => {}};
 	return $self->{optimized} = $cfg;
 }
 
+=head2 match($host, $user, $event)
+
+Return reference to array of actions which should be invoked for data of $event
+sent by $user from $host (ip as long). Action is matched when all its conditions
+matched. Actions that have no conditions are at the end of the list.
+Result is cached for each sender, user and event combination, so it could be
+called once for each received event. load_optimized() should be called before.
+
+=cut
+
+sub match {
+	my ($self, $host, $user, $event) = @_;
+	
+	my $matcher = $self->{matcher};
+	my $key = join("\0", $host, $user, $event);
+	if (my $acting = $matcher->{cache}{$key}) {
+		return $acting;
+	}
+	
+	my $cfg = $self->{optimized};
+	my (%sender, %user, %event);
+	
+	$sender{$_} = 1 for @{$cfg->{senders}{$host} || []}, $matcher->{trie}->lookup_all($host);
+	$user{$_}  = 1 for @{$cfg->{users}{$user} || []};
+	$event{$_} = 1 for @{$cfg->{events}{$event} || []};
+	
+	my @acting;
+	foreach my $rule (@{$matcher->{rules}}) {
+		my ($action, $by_sender, $by_user, $by_event) = @$rule;
+		
+		next if $by_sender && !$sender{$action};
+		next if $by_user   && !$user{$action};
+		next if $by_event  && !$event{$action};
+		
+		push @acting, $action->{action};
+	}
+	push @acting, @{$cfg->{actions}};
+	
+	if (keys %{$matcher->{cache}} >= $MATCH_CACHE_SIZE) {
+		$matcher->{cache} = {};
+	}
+	
+	return $matcher->{cache}{$key} = \@acting;
+}
+
 1;
@@ -2,6 +2,7 @@ package Mine::Config::Hosts;
 
 use strict;
 use Mine::Utils::IP qw(cidr2long host2long splitbycidr);
+use Mine::Utils::IPTrie;
 use base Mine::Config::;
 
 =head1 NAME
@@ -72,18 +73,23 @@ Format is:
 		]
 	}
 
+In addition networks are stored in Mine::Utils::IPTrie object in $self->{trie},
+so allowed() could check ip regardless of networks count.
+
 =cut
 
 sub load_optimized {
 	my ($self) = @_;
 	
 	my $cfg = {ip => {}, netmask => []};
+	my $trie = Mine::Utils::IPTrie->new();
 	foreach my $elt (@{$self->{data}}) {
 		eval {
 			if (my ($net, $cidr) = splitbycidr($elt)) {
 				$net  = host2long($net);
 				$cidr = cidr2long($cidr);
 				push @{$cfg->{netmask}}, $net, $cidr;
+				$trie->add($net, $cidr, 1);
 			}
 			else {
 				$cfg->{ip}{host2long($elt)} = 1;
@@ -91,7 +97,21 @@ sub load_optimized {
 		};
 	}
 	
+	$self->{trie} = $trie;
 	return $self->{optimized} = $cfg;
 }
 
+=head2 allowed($ip)
+
+Returns true if ip (as long) is in the config as host or belongs to some network from
+the config. load_optimized() should be called before.
+
+=cut
+
+sub allowed {
+	my ($self, $ip) = @_;
+	
+	return exists($self->{optimized}{ip}{$ip}) || defined($self->{trie}->lookup($ip));
+}
+
 1;
@@ -29,6 +29,11 @@ sub new {
 	$self->{data}{bind_port} = DEFAULT_PORT unless exists $self->{data}{bind_port};
 	$self->{data}{ssl} = JSON::XS::false    unless exists $self->{data}{ssl};
 	$self->{data}{ipauth} = JSON::XS::false unless exists $self->{data}{ipauth};
+	$self->{data}{ssl_session_cache} = 1024 unless exists $self->{data}{ssl_session_cache};
+	$self->{data}{out_queue_limit} = DEFAULT_OUT_QUEUE_LIMIT unless exists $self->{data}{out_queue_limit};
+	$self->{data}{out_queue_policy} = 'disconnect' unless exists $self->{data}{out_queue_policy};
+	$self->{data}{last_value_size} = DEFAULT_LAST_VALUE_SIZE unless exists $self->{data}{last_value_size};
+	$self->{data}{last_value_limit} = DEFAULT_LAST_VALUE_LIMIT unless exists $self->{data}{last_value_limit};
 	
 	$self->validate();
 	return $self;
@@ -45,9 +50,42 @@ Valid config forms is:
 		bind_address: 'x.x.x.x',
 		bind_port: [0-9]+,
 		ssl: true|false
-		ipauth: true|false
+		ssl_session_cache: [0-9]+, # sessions to resume, 0 disables
+		ipauth: true|false,
+		unix_path: '/path/to/socket', # optional
+		shm_path: '/dev/shm/mine',    # optional, shared memory ring of mined
+		shm_size: [0-9]+,             # ring size in bytes
+		out_queue_limit: [0-9]+,      # bytes queued for each client, 0 is unlimited
+		out_queue_policy: 'disconnect'|'drop_oldest'|'drop_newest'|'spill',
+		spill_path: '/var/tmp',       # optional, directory for spilled queues
+		last_value_events: ['EV', ...], # optional, events which last values are cached
+		last_value_size: [0-9]+,      # biggest cached message in bytes
+		last_value_limit: [0-9]+,     # bytes for all cached messages
+		journal_path: '/var/lib/mine', # optional, journal directory of mined
+		journal_segment_size: [0-9]+, # journal file size in bytes
+		journal_segments: [0-9]+,     # journal files to keep, 0 keeps all
+		journal_sync: [0-9]+          # milliseconds between journal syncs
 	}
 
+Every published event goes to the ring at `shm_path', whatever hosts.cfg and
+users.cfg say and whether somebody registered it or not. The ring file is created
+with mode 0640, so its owner and group are the only access control: everybody who
+could read the file gets all events.
+
+Policy says what to do with message which does not fit the queue of slow client:
+disconnect client, drop oldest queued messages to make room, drop the new message
+or write the queue to the disk.
+
+Last message of each event listed in `last_value_events' is kept for each publisher
+and sent to the client right after it registered the event, so it has current state
+without waiting for the next message. Messages bigger than `last_value_size' are not
+cached and least recently updated values are dropped when cache exceeds `last_value_limit'.
+
+When `journal_path' is set each message gets sequence number and is appended to the
+journal, so the client may register event starting from some number and get missed
+messages before the live ones. Journal is synced to the disk each `journal_sync'
+milliseconds, so messages of the last interval may be lost on power failure.
+
 =cut
 
 sub validate {
@@ -70,8 +108,50 @@ sub validate {
 	exists $cfg->{ssl} && !JSON::XS::is_bool($cfg->{ssl})
 		and die 'validate(): `ssl\' should be true or false';
 	
+	exists $cfg->{ssl_session_cache} && $cfg->{ssl_session_cache} !~ /^\d+$/
+		and die 'validate(): `ssl_session_cache\' should be numeric';
+	
 	exists $cfg->{ipauth} && !JSON::XS::is_bool($cfg->{ipauth})
 		and die 'validate(): `ipauth\' should be true or false';
+	
+	exists $cfg->{unix_path} && (ref $cfg->{unix_path} || !defined $cfg->{unix_path})
+		and die 'validate(): `unix_path\' should be a string';
+	
+	exists $cfg->{shm_path} && (ref $cfg->{shm_path} || !defined $cfg->{shm_path})
+		and die 'validate(): `shm_path\' should be a string';
+	
+	exists $cfg->{shm_size} && $cfg->{shm_size} !~ /^\d+$/
+		and die 'validate(): `shm_size\' should be numeric';
+	
+	exists $cfg->{out_queue_limit} && $cfg->{out_queue_limit} !~ /^\d+$/
+		and die 'validate(): `out_queue_limit\' should be numeric';
+	
+	exists $cfg->{out_queue_policy} && (!defined $cfg->{out_queue_policy} || $cfg->{out_queue_policy} !~ /^(?:disconnect|drop_oldest|drop_newest|spill)$/)
+		and die 'validate(): `out_queue_policy\' should be disconnect, drop_oldest, drop_newest or spill';
+	
+	exists $cfg->{spill_path} && (ref $cfg->{spill_path} || !defined $cfg->{spill_path})
+		and die 'validate(): `spill_path\' should be a string';
+	
+	exists $cfg->{last_value_events} && (ref $cfg->{last_value_events} ne 'ARRAY' || grep { ref $_ || !defined $_ || length $_ > 255 } @{$cfg->{last_value_events}})
+		and die 'validate(): `last_value_events\' should be an array of event names';
+	
+	exists $cfg->{last_value_size} && $cfg->{last_value_size} !~ /^\d+$/
+		and die 'validate(): `last_value_size\' should be numeric';
+	
+	exists $cfg->{last_value_limit} && $cfg->{last_value_limit} !~ /^\d+$/
+		and die 'validate(): `last_value_limit\' should be numeric';
+	
+	exists $cfg->{journal_path} && (ref $cfg->{journal_path} || !defined $cfg->{journal_path})
+		and die 'validate(): `journal_path\' should be a string';
+	
+	exists $cfg->{journal_segment_size} && $cfg->{journal_segment_size} !~ /^\d+$/
+		and die 'validate(): `journal_segment_size\' should be numeric';
+	
+	exists $cfg->{journal_segments} && $cfg->{journal_segments} !~ /^\d+$/
+		and die 'validate(): `journal_segments\' should be numeric';
+	
+	exists $cfg->{journal_sync} && $cfg->{journal_sync} !~ /^\d+$/
+		and die 'validate(): `journal_sync\' should be numeric';
 }
 
 1;
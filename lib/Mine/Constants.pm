@@ -4,6 +4,9 @@ use constant {
 	CONFIG_PATH  => 'tmp/cfg',
 	CERT_PATH    => 'tmp/cert',
 	DEFAULT_PORT => 1135,
+	DEFAULT_OUT_QUEUE_LIMIT => 64*1024*1024,
+	DEFAULT_LAST_VALUE_SIZE => 64*1024,
+	DEFAULT_LAST_VALUE_LIMIT => 16*1024*1024,
 };
 
 sub import {
@@ -28,12 +28,27 @@ sub send : EV_SAFE {
 		DEBUG && warn "send_auth($handle, $response)";
 		
 		if ($response eq PROTO_AUTH_SUCCESS) {
-			if (defined $event) {
-				$handle->push_write(pack('CCa*', PROTO_EVENT_SND, length($event), $event));
+			my $ids = $handle->{_mine}{ids};
+			if (defined $event && defined $datalen && $handle->{_mine}{caps} & PROTO_CAP_EVENT_ID &&
+			    (exists $ids->{$event} || keys(%$ids) < PROTO_EVENT_IDS)) {
+				unless (exists $ids->{$event}) {
+					# first use of the name, define its id
+					$ids->{$event} = keys %$ids;
+					$handle->push_write(pack('CwC/a*', PROTO_EVENT_DEF, $ids->{$event}, $event));
+				}
+				$handle->push_write(pack('Cww', PROTO_EVENT_ID_DATA_SND, $ids->{$event}, $datalen));
 			}
-			
-			if (defined $datalen) {
-				$handle->push_write(pack('CQ', PROTO_DATA_SND, $datalen));
+			elsif (defined $event && defined $datalen && $handle->{_mine}{caps} & PROTO_CAP_COMPACT) {
+				$handle->push_write(pack('CC/a*w', PROTO_EVENT_DATA_SND, $event, $datalen));
+			}
+			else {
+				if (defined $event) {
+					$handle->push_write(pack('CCa*', PROTO_EVENT_SND, length($event), $event));
+				}
+				
+				if (defined $datalen) {
+					$handle->push_write(pack('CQ', PROTO_DATA_SND, $datalen));
+				}
 			}
 			
 			if (defined $data) {
@@ -52,6 +67,17 @@ sub send : EV_SAFE {
 		}
 	};
 	
+	# v1 server never answers, so v1 protocol used until this
+	my $hello_reply = sub {
+		my ($handle, $op, $version, $caps) = ($_[0], unpack('CCN', $_[1]));
+		DEBUG && warn "hello_reply($handle, $op, $version, $caps)";
+		
+		if ($op == PROTO_HELLO) {
+			$handle->{_mine}{version} = $version < PROTO_VERSION ? $version : PROTO_VERSION;
+			$handle->{_mine}{caps} = $caps & PROTO_CAPS;
+		}
+	};
+	
 	my $conn_reply = sub {
 		my ($handle, $response) = ($_[0], unpack('C', $_[1]));
 		DEBUG && warn "conn_reply($handle, $response)";
@@ -63,14 +89,17 @@ sub send : EV_SAFE {
 		my $l_len = length $login;
 		my $p_len = length $password;
 		
+		# hello goes together with login, v1 server just ignores it
 		$stash->{handles}{$nr}->push_write(
 			my $d = pack("C", $l_len) .
 			$login .
 			pack("C", $p_len) .
-			$password
+			$password .
+			pack('CCa5CN', PROTO_EVENT_SND, 10, PROTO_HELLO_MAGIC, PROTO_VERSION, PROTO_CAPS)
 		);
 		
 		$stash->{handles}{$nr}->push_read(chunk => 1, $auth_reply);
+		$stash->{handles}{$nr}->push_read(chunk => 6, $hello_reply);
 	};
 	
 	if(!exists($stash->{handles}{$nr}) || $stash->{handles}{$nr}->destroyed) {
@@ -83,6 +112,9 @@ sub send : EV_SAFE {
 		$stash->{handles}{$nr}->push_read(chunk => 1, $conn_reply);
 		$stash->{handles}{$nr}{_mine}{ready} = 0;
 		$stash->{handles}{$nr}{_mine}{queue} = [];
+		$stash->{handles}{$nr}{_mine}{version} = 1;
+		$stash->{handles}{$nr}{_mine}{caps} = 0;
+		$stash->{handles}{$nr}{_mine}{ids} = {};
 		
 	}
 	else {
@@ -12,8 +12,34 @@ use constant {
 	PROTO_WAITING        => 4,
 	PROTO_AUTH_SUCCESS   => 1,
 	PROTO_AUTH_FAILED    => 0,
+	PROTO_HELLO          => 5,
+	PROTO_HELLO_MAGIC    => "\0MINE",
+	PROTO_VERSION        => 2,
+	PROTO_EVENT_DATA_RCV => 6,
+	PROTO_EVENT_DATA_SND => 6,
+	PROTO_EVENT_DEF      => 7,
+	PROTO_EVENT_ID_DATA_RCV => 8,
+	PROTO_EVENT_ID_DATA_SND => 8,
+	PROTO_EVENT_IDS      => 65536, # event ids are less than this
+	PROTO_EVENT_REG_MULTI => 9,
+	PROTO_EVENT_UNREG    => 10,
+	PROTO_EVENT_REG_GROUP => 11,
+	PROTO_EVENT_REG_FLAGS => 12,
+	PROTO_EVENT_REG_FROM => 13, # registration starting from journal sequence number
+	PROTO_EVENT_SEQ      => 14, # sequence number of the next message
+	PROTO_GROUP_STICKY   => 1, # messages of one publisher go to the same member
+	PROTO_GROUP_LEAVE    => 2, # cancel membership
+	PROTO_REG_CONFLATE   => 1, # only the newest undelivered message of the event is kept
+	PROTO_CAP_COMPACT    => 1, # event, BER compressed length and data in one frame
+	PROTO_CAP_EVENT_ID   => 2, # event names interned to numeric ids per connection
+	PROTO_CAP_SUBSCRIBE  => 4, # many registrations in one frame and unregistration
+	PROTO_CAP_GROUP      => 8, # queue groups, each message goes to one member
+	PROTO_CAP_CONFLATE   => 16, # registration flags with conflation
+	PROTO_CAP_JOURNAL    => 32, # journaled messages, advertised by mined only
 };
 
+use constant PROTO_CAPS => PROTO_CAP_COMPACT | PROTO_CAP_EVENT_ID | PROTO_CAP_SUBSCRIBE | PROTO_CAP_GROUP | PROTO_CAP_CONFLATE; # capabilities supported by this implementation
+
 sub import {
 	my $caller = caller;
 	
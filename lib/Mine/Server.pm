@@ -6,10 +6,12 @@ use AnyEvent;
 use AnyEvent::Socket;
 use AnyEvent::Handle;
 use Digest::MD5 qw(md5_hex);
+use File::Temp;
+use File::Spec;
 use Mine::Config::Main;
 use Mine::Config::Actions;
 use Mine::Config::Users;
-use Mine::Utils::IP qw(host2long ip_belongs_net);
+use Mine::Utils::IP qw(host2long);
 use Mine::Constants;
 use Mine::Protocol;
 use Mine::PluginManager;
@@ -31,6 +33,7 @@ Mine::Server - Mine server class (singleton)
 =cut
 
 use constant DEBUG => $ENV{MINE_DEBUG};
+use constant OUT_CHUNK => 65536; # bytes of the queue given to the handle at once
 
 # some prototypes
 sub _($);
@@ -82,8 +85,45 @@ sub new {
 		$self->{cfg}{hosts}->load_optimized();
 	}
 	
+	# one tls context for all connections, so cert and key loaded once
+	# and sessions could be resumed by reconnected clients
+	if ($self->{cfg}{main}{data}{ssl}) {
+		require AnyEvent::TLS;
+		require Net::SSLeay;
+		
+		my $cache_size = $self->{cfg}{main}{data}{ssl_session_cache};
+		$self->{tls_ctx} = AnyEvent::TLS->new(
+			cert_file => CERT_PATH . '/mine.crt',
+			key_file  => CERT_PATH . '/mine.key',
+			prepare   => sub {
+				my $ctx = $_[0]->ctx;
+				
+				if ($cache_size) {
+					# tickets are encrypted by keys of this context
+					# and valid until server restart
+					Net::SSLeay::CTX_set_session_id_context($ctx, 'mine', 4);
+					Net::SSLeay::CTX_set_session_cache_mode($ctx, Net::SSLeay::SESS_CACHE_SERVER());
+					Net::SSLeay::CTX_sess_set_cache_size($ctx, $cache_size);
+				}
+				else {
+					Net::SSLeay::CTX_set_session_cache_mode($ctx, Net::SSLeay::SESS_CACHE_OFF());
+					Net::SSLeay::CTX_set_options($ctx, Net::SSLeay::OP_NO_TICKET());
+				}
+			}
+		);
+	}
+	
 	$self->{plugins} = Mine::PluginManager->new();
 	
+	# cached routes are valid while generation of waiting is the same
+	$self->{waiting_gen} = 1;
+	
+	# last values of these events are replayed to new subscribers, see _remember()
+	$self->{lv_events} = { map { $_ => 1 } @{$self->{cfg}{main}{data}{last_value_events} || []} };
+	$self->{lv} = {};     # event => {ip => [data, seq]}
+	$self->{lv_lru} = []; # [event, ip, seq] in order of update
+	$self->{lv_bytes} = $self->{lv_count} = $self->{lv_seq} = 0;
+	
 	bless $self, $class;
 }
 
@@ -100,10 +140,47 @@ sub start {
 		\&_cb_accept
 	);
 	
+	if (my $path = $self->{cfg}{main}{data}{unix_path}) {
+		# socket file remains after previous run
+		unlink $path if -S $path;
+		tcp_server('unix/', $path, \&_cb_accept);
+	}
+	
+	# dump output queues of the clients
+	$self->{sigusr1} = AnyEvent->signal(signal => 'USR1', cb => sub {
+		warn sprintf("%s@%s: depth %d, peak %d, dropped %d, spilled %d, conflated %d\n",
+			@$_{qw(user host depth peak dropped spilled conflated)}) for $self->queues();
+	});
+	
 	$self->{loop} = AnyEvent->condvar;
 	$self->{loop}->recv;
 }
 
+=head2 queues()
+
+Returns list of hashes with output queue counters of the connected clients:
+host, user, depth (bytes queued now), peak (max depth), dropped (messages
+dropped by out_queue_policy), spilled (bytes written to the disk) and conflated
+(messages replaced by newer ones of conflated subscriptions). Server prints them
+to STDERR on SIGUSR1.
+
+=cut
+
+sub queues {
+	map {
+		my $mine = $_->{_mine};
+		{
+			host    => join('.', unpack('C4', pack('N', $mine->{host}))),
+			user    => $mine->{user},
+			depth   => _depth($_),
+			peak    => $mine->{peak},
+			dropped => $mine->{dropped},
+			spilled => $mine->{spilled},
+			conflated => $mine->{conflated}
+		}
+	} values %{$self->{handles}};
+}
+
 
 #### callbacks ####
 
@@ -115,7 +192,8 @@ After client connection server sends to client connection
 type 1 byte longwithout any encryption. Connection type can be
 PROTO_SSL or PROTO_PLAIN. If connection type is PROTO_SSL then server
 starts ssl handshaking, so client should start ssl handshaking
-too:
+too. Connections to the unix socket (see unix_path in main.cfg) are
+always PROTO_PLAIN and treated as coming from 127.0.0.1:
 
   +--------------------------+
   |            1             |
@@ -128,12 +206,16 @@ too:
 sub _cb_accept {
 	my ($sock, $host) = @_;
 	
+	# unix socket client is on the same host and needs no encryption
+	my $local = $host eq 'unix/';
+	$host = '127.0.0.1' if $local;
+	
 	my @conn_opts;
-	if ($self->{cfg}{main}{data}{ssl}) {
+	if ($self->{cfg}{main}{data}{ssl} && !$local) {
 		push(
 			@conn_opts, pack('C', PROTO_SSL),
 			tls => 'accept',
-			tls_ctx => {cert_file => CERT_PATH . '/mine.crt', key_file => CERT_PATH . '/mine.key'}
+			tls_ctx => $self->{tls_ctx}
 		);
 	}
 	else {
@@ -150,10 +232,25 @@ sub _cb_accept {
 		fh => $sock,
 		@conn_opts,
 		on_read  => \&_cb_read,
+		on_drain => \&_cb_drain,
 		on_eof   => \&_cb_error,
 		on_error => \&_cb_error
 	);
 	$handle->{_mine}{state} = PROTO_AUTH;
+	$handle->{_mine}{version} = 1; # until client will say hello
+	$handle->{_mine}{caps} = 0;
+	$handle->{_mine}{route} = [undef, 0];
+	$handle->{_mine}{subs} = {};
+	$handle->{_mine}{conflate} = {};
+	$handle->{_mine}{groups} = {};
+	$handle->{_mine}{id} = ++$self->{conn_seq};
+	$handle->{_mine}{skip} = {};
+	# output queue, see _push()
+	$handle->{_mine}{oq} = '';
+	$handle->{_mine}{qpos} = 0;
+	$handle->{_mine}{marks} = [];
+	$handle->{_mine}{spill_rd} = $handle->{_mine}{spill_wr} = 0;
+	$handle->{_mine}{peak} = $handle->{_mine}{dropped} = $handle->{_mine}{spilled} = $handle->{_mine}{conflated} = 0;
 	$handle->{_mine}{host} = host2long($host);
 	$handle->{_mine}{stash} = {};
 	$self->{handles}{_$handle} = $handle; # see sub _($)
@@ -161,13 +258,19 @@ sub _cb_accept {
 
 sub _cb_read {
 	my ($handle) = @_;
+	my $mine = $handle->{_mine};
+	my $rbuf = \$handle->{rbuf};
+	my $len  = length $$rbuf;
+	my $pos  = 0;
 	
-	given ($handle->{_mine}{state}) {
-		when (PROTO_WAITING) {
-			my $state = unpack('C', _strshift($handle->{rbuf}));
-			
-			$handle->{_mine}{state} = $state;
-			goto &_cb_read if length $handle->{rbuf} > 0;
+	# walk all complete frames from the read offset
+	# and compact buffer only once at the end
+	while ($pos < $len) {
+		my $state = $mine->{state};
+		
+		if ($state == PROTO_WAITING) {
+			$mine->{state} = unpack('@'.$pos.'C', $$rbuf);
+			$pos++;
 		}
 
 =head2 Authorization
@@ -194,50 +297,32 @@ If authorization by ip enabled and client ip marked as allowed
 server must admit such client.
 
 =cut
-		when (PROTO_AUTH) {
-			unless (exists $handle->{_mine}{user}) {
-				# reading username
-				my $ulen = unpack('C', $handle->{rbuf});
-				
-				if ($ulen == 0) {
-					# anonymous
-					_strshift($handle->{rbuf});
-					$handle->{_mine}{user} = '';
-				}
-				elsif (length($handle->{rbuf}) > $ulen) {
-					# username
-					_strshift($handle->{rbuf});
-					$handle->{_mine}{user} = _strshift($handle->{rbuf}, $ulen);
-				}
-			}
+		elsif ($state == PROTO_AUTH) {
+			my $ulen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $ulen + 2;
+			my $plen = unpack('@'.($pos+$ulen+1).'C', $$rbuf);
+			last if $len - $pos < $ulen + $plen + 2;
 			
-			if (length($handle->{rbuf}) > 0) {
-				my $plen = unpack('C', $handle->{rbuf});
-				
-				if ($plen == 0) {
-					# anonymous
-					_strshift($handle->{rbuf});
-					$handle->{_mine}{password} = '';
-				}
-				elsif (length($handle->{rbuf}) > $plen) {
-					# password
-					_strshift($handle->{rbuf});
-					$handle->{_mine}{password} = _strshift($handle->{rbuf}, $plen);
-				}
-				else {
-					# still not authorized
-					return;
-				}
-				
-				if (_can_auth($handle->{_mine}{host}, $handle->{_mine}{user}, $handle->{_mine}{password})) {
-					$handle->push_write(pack('C', PROTO_AUTH_SUCCESS));
-					$handle->{_mine}{state} = PROTO_WAITING;
-				}
-				else {
-					$handle->push_write(pack('C', PROTO_AUTH_FAILED));
-					delete $self->{handles}{_$handle};
-					$handle->destroy();
+			($mine->{user}, $mine->{password}) = unpack('@'.$pos.'C/aC/a', $$rbuf);
+			$pos += $ulen + $plen + 2;
+			
+			if (_can_auth($mine->{host}, $mine->{user}, $mine->{password})) {
+				my $status = pack('C', PROTO_AUTH_SUCCESS);
+				# v2 client sends hello together with login, so answer it in one write
+				if ($len - $pos >= 12 && substr($$rbuf, $pos, 2) eq pack('CC', PROTO_EVENT_RCV, 10)) {
+					if (defined(my $reply = _hello($mine, substr($$rbuf, $pos+2, 10)))) {
+						$status .= $reply;
+						$pos += 12;
+					}
 				}
+				$handle->push_write($status);
+				$mine->{state} = PROTO_WAITING;
+			}
+			else {
+				$handle->push_write(pack('C', PROTO_AUTH_FAILED));
+				delete $self->{handles}{_$handle};
+				$handle->destroy();
+				return;
 			}
 		}
 
@@ -254,22 +339,149 @@ from the server:
 
 Ip could be "0.0.0.0" that means "any ip". Server will
 resent event and data to clients in the same format it
-receivs from clients.
+receivs from clients. Client could register any number
+of events.
+
+If both sides support PROTO_CAP_SUBSCRIBE, client could
+register many events with one frame. Count is BER compressed
+integer and registrations follow without PROTO_EVENT_REG:
+
+  +-----------------------+-------+------+-------+-----+-----+
+  |           1           |  1-10 |   1  | 1-255 |  4  | ... |
+  +-----------------------+-------+------+-------+-----+-----+
+  | PROTO_EVENT_REG_MULTI | count | elen | event |  ip | ... |
+  +-----------------------+-------+------+-------+-----+-----+
+
+And cancel registration:
+
+  +-------------------+------+-------+-----+
+  |         1         |  1   | 1-255 |  4  |
+  +-------------------+------+-------+-----+
+  | PROTO_EVENT_UNREG | elen | event |  ip |
+  +-------------------+------+-------+-----+
+
+If both sides support PROTO_CAP_GROUP, client could join queue
+group of the event instead. Each message of the event goes to
+one member of each group, the one with the shortest output queue:
+
+  +-----------------------+------+-------+-----+-------+------+-------+
+  |           1           |  1   | 1-255 |  4  |   1   |   1  | 0-255 |
+  +-----------------------+------+-------+-----+-------+------+-------+
+  | PROTO_EVENT_REG_GROUP | elen | event |  ip | flags | glen | group |
+  +-----------------------+------+-------+-----+-------+------+-------+
+
+Flags are PROTO_GROUP_STICKY, if group should send all messages of
+the publisher to the same member while members are the same (it
+is decided by the first member), and PROTO_GROUP_LEAVE to leave
+the group.
+
+If both sides support PROTO_CAP_CONFLATE, client could register
+the event with flags:
+
+  +-----------------------+------+-------+-----+-------+
+  |           1           |  1   | 1-255 |  4  |   1   |
+  +-----------------------+------+-------+-----+-------+
+  | PROTO_EVENT_REG_FLAGS | elen | event |  ip | flags |
+  +-----------------------+------+-------+-----+-------+
+
+With PROTO_REG_CONFLATE client which does not read fast enough gets
+only the newest message of the event: new message replaces queued
+one which was not written to the client yet, so it moves to the end
+of the queue. Flags of the last registration of the event are used.
+
+If last value of the event is cached (see last_value_events in main.cfg),
+client gets the last message of each matched publisher right after
+registration of the event, same way as other events. Messages are not
+replayed when client already registered the event or joined a group.
+
+If server supports PROTO_CAP_JOURNAL (only mined does, when journal_path
+is set in main.cfg), client could register the event starting from
+sequence number of the journal, 0 is the oldest kept message:
+
+  +----------------------+------+-------+-----+------+
+  |           1          |  1   | 1-255 |  4  | 1-10 |
+  +----------------------+------+-------+-----+------+
+  | PROTO_EVENT_REG_FROM | elen | event |  ip |  seq |
+  +----------------------+------+-------+-----+------+
+
+Seq is BER compressed integer. Server sends journaled messages of
+the event first and then live ones, each of them after its number:
+
+  +-----------------+------+
+  |        1        | 1-10 |
+  +-----------------+------+
+  | PROTO_EVENT_SEQ |  seq |
+  +-----------------+------+
+
+So client which remembers number of the last received message could
+register from the next one after reconnection and miss nothing, unless
+the message was already removed from the journal.
 
 =cut
-		when (PROTO_EVENT_REG) {
-			my $elen = unpack('C', $handle->{rbuf});
+		elsif ($state == PROTO_EVENT_REG_MULTI) {
+			my $clen = _ber_len($rbuf, $pos);
+			last unless $clen;
+			if ($clen < 0) {
+				DEBUG && warn "Bad registrations count";
+				_cb_error($handle, 1, 'Bad registrations count');
+				return;
+			}
+			
+			$mine->{regs_left} = unpack('@'.$pos.'w', $$rbuf);
+			$pos += $clen;
+			DEBUG && warn "PROTO_EVENT_REG_MULTI: $mine->{regs_left}";
+			$mine->{state} = $mine->{regs_left} ? PROTO_EVENT_REG : PROTO_WAITING;
+		}
+		elsif ($state == PROTO_EVENT_REG_GROUP) {
+			my $elen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $elen + 7;
+			my $glen = unpack('@'.($pos+$elen+6).'C', $$rbuf);
+			last if $len - $pos < $elen + $glen + 7;
 			
-			if (length($handle->{rbuf}) > $elen+4) {
-				my (undef, $event, $ip) = 
-					unpack('Ca'.$elen.'a4', _strshift($handle->{rbuf}, $elen+5));
-					
-				DEBUG && warn "PROTO_EVENT_REG: $event, " . join('.', unpack('C4', $ip));
-				my $key = $ip.$event;
-				$self->{waiting}{$key}{_$handle} = $handle;
-				$self->{handles}{_$handle} = $key;
-				$handle->{_mine}{state} = PROTO_WAITING;
+			my ($event, $ip, $flags, $group) = unpack('@'.($pos+1).'a'.$elen.'a4CC/a', $$rbuf);
+			$pos += $elen + $glen + 7;
+			
+			DEBUG && warn "PROTO_EVENT_REG_GROUP: $event, " . join('.', unpack('C4', $ip)) . ", $group, $flags";
+			if ($flags & PROTO_GROUP_LEAVE) {
+				_leave_group($handle, $ip.$event, $group);
+			}
+			else {
+				_join_group($handle, $ip.$event, $group, $flags & PROTO_GROUP_STICKY);
 			}
+			$mine->{state} = PROTO_WAITING;
+		}
+		elsif ($state == PROTO_EVENT_REG_FLAGS) {
+			my $elen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $elen + 6;
+			
+			my ($event, $ip, $flags) = unpack('@'.($pos+1).'a'.$elen.'a4C', $$rbuf);
+			$pos += $elen + 6;
+			
+			DEBUG && warn "PROTO_EVENT_REG_FLAGS: $event, " . join('.', unpack('C4', $ip)) . ", $flags";
+			_replay($handle, $ip.$event) if _subscribe($handle, $ip.$event, $flags & PROTO_REG_CONFLATE) && $self->{lv_count};
+			# replay could disconnect the client by out_queue_policy
+			return if $handle->destroyed;
+			$mine->{state} = PROTO_WAITING;
+		}
+		elsif ($state == PROTO_EVENT_REG || $state == PROTO_EVENT_UNREG) {
+			my $elen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $elen + 5;
+			
+			my ($event, $ip) = unpack('@'.($pos+1).'a'.$elen.'a4', $$rbuf);
+			$pos += $elen + 5;
+			
+			if ($state == PROTO_EVENT_UNREG) {
+				DEBUG && warn "PROTO_EVENT_UNREG: $event, " . join('.', unpack('C4', $ip));
+				_unsubscribe($handle, $ip.$event);
+				$mine->{state} = PROTO_WAITING;
+				next;
+			}
+			
+			DEBUG && warn "PROTO_EVENT_REG: $event, " . join('.', unpack('C4', $ip));
+			_replay($handle, $ip.$event) if _subscribe($handle, $ip.$event) && $self->{lv_count};
+			return if $handle->destroyed;
+			$mine->{regs_left}-- if $mine->{regs_left};
+			$mine->{state} = $mine->{regs_left} ? PROTO_EVENT_REG : PROTO_WAITING;
 		}
 
 =head2 Event receiving
@@ -282,14 +494,153 @@ Event from the client format should be:
   | PROTO_EVENT_SND | elen |  event |
   +-----------------+------+--------+
 
+=head2 Capability negotiation
+
+Protocol version 2 client sends right after authorization special
+event, which is harmless for version 1 server:
+
+  +-----------------+----+-------------------+---------+------+
+  |        1        |  1 |         5         |    1    |   4  |
+  +-----------------+----+-------------------+---------+------+
+  | PROTO_EVENT_SND | 10 | PROTO_HELLO_MAGIC | version | caps |
+  +-----------------+----+-------------------+---------+------+
+
+Version 2 server responds with its version and capabilities:
+
+  +-------------+---------+------+
+  |      1      |    1    |   4  |
+  +-------------+---------+------+
+  | PROTO_HELLO | version | caps |
+  +-------------+---------+------+
+
+Each side uses only capabilities supported by both sides and only
+after it knows capabilities of other side. Until then and with
+version 1 peers protocol version 1 described here is used.
+
 =cut
-		when (PROTO_EVENT_RCV) {
-			my $elen = unpack('C', $handle->{rbuf});
-			if (length($handle->{rbuf}) > $elen) {
-				_strshift($handle->{rbuf});
-				$handle->{_mine}{event} = _strshift($handle->{rbuf}, $elen);
-				$handle->{_mine}{state} = PROTO_WAITING;
+		elsif ($state == PROTO_EVENT_RCV) {
+			my $elen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $elen + 1;
+			
+			my $event = substr($$rbuf, $pos+1, $elen);
+			$pos += $elen + 1;
+			$mine->{state} = PROTO_WAITING;
+			
+			if (defined(my $reply = _hello($mine, $event))) {
+				$handle->push_write($reply);
+				next;
 			}
+			
+			$mine->{event} = $event;
+			$mine->{route} = [undef, 0];
+		}
+
+=head2 Compact event
+
+If both sides support PROTO_CAP_COMPACT, event and data length
+could be sent in one frame. Length is BER compressed integer
+(perl's pack 'w'), so small messages need few bytes of framing:
+
+  +----------------------+------+--------+------+------------+
+  |           1          |   1  |  0-255 | 1-10 |            |
+  +----------------------+------+--------+------+------------+
+  | PROTO_EVENT_DATA_SND | elen |  event | dlen |    data    |
+  +----------------------+------+--------+------+------------+
+
+Frame makes event current as PROTO_EVENT_SND does and data is
+handled as described below. Server sends events in this format
+to subscribers which support it.
+
+=cut
+		elsif ($state == PROTO_EVENT_DATA_RCV) {
+			my $elen = unpack('@'.$pos.'C', $$rbuf);
+			last if $len - $pos < $elen + 2;
+			
+			my $dlen = _ber_len($rbuf, $pos+$elen+1);
+			last unless $dlen;
+			if ($dlen < 0) {
+				DEBUG && warn "Bad compact frame length";
+				_cb_error($handle, 1, 'Bad compact frame length');
+				return;
+			}
+			
+			($mine->{event}, $mine->{datalen}) = unpack('@'.$pos.'C/aw', $$rbuf);
+			$pos += $elen + 1 + $dlen;
+			$mine->{route} = [undef, 0];
+			$mine->{state} = PROTO_DATA_RCV;
+			$mine->{first} = 1;
+			redo;
+		}
+
+=head2 Event ids
+
+If both sides support PROTO_CAP_EVENT_ID, sender could define
+numeric id of the event name once per connection:
+
+  +-----------------+------+------+-------+
+  |        1        | 1-3  |   1  | 0-255 |
+  +-----------------+------+------+-------+
+  | PROTO_EVENT_DEF |  id  | elen | event |
+  +-----------------+------+------+-------+
+
+And then send events by id only:
+
+  +-------------------------+------+------+------------+
+  |            1            | 1-3  | 1-10 |            |
+  +-------------------------+------+------+------------+
+  | PROTO_EVENT_ID_DATA_SND |  id  | dlen |    data    |
+  +-------------------------+------+------+------------+
+
+Both id and dlen are BER compressed integers, id is less than
+PROTO_EVENT_IDS. Ids of each direction are independent and
+chosen by the sender. Server uses the same id for the event
+for all subscribers and remembers subscribers of the event by
+id until somebody registers or leaves.
+
+=cut
+		elsif ($state == PROTO_EVENT_DEF) {
+			my $ilen = _ber_len($rbuf, $pos);
+			last if $ilen == 0 || $ilen > 0 && $len - $pos < $ilen + 1;
+			
+			my ($id, $elen) = $ilen > 0 ? unpack('@'.$pos.'wC', $$rbuf) : (PROTO_EVENT_IDS, 0);
+			if ($id >= PROTO_EVENT_IDS) {
+				DEBUG && warn "Bad event id";
+				_cb_error($handle, 1, 'Bad event id');
+				return;
+			}
+			last if $len - $pos < $ilen + $elen + 1;
+			
+			my $event = substr($$rbuf, $pos+$ilen+1, $elen);
+			$pos += $ilen + $elen + 1;
+			
+			DEBUG && warn "PROTO_EVENT_DEF: $id, $event";
+			if ($mine->{routes}[$id] && $mine->{route} == $mine->{routes}[$id]) {
+				# current event redefined, but it remains current
+				$mine->{route} = [undef, 0];
+			}
+			$mine->{routes}[$id] = [_intern($event), 0];
+			$mine->{state} = PROTO_WAITING;
+		}
+		elsif ($state == PROTO_EVENT_ID_DATA_RCV) {
+			my $ilen = _ber_len($rbuf, $pos);
+			my $dlen = $ilen > 0 ? _ber_len($rbuf, $pos+$ilen) : $ilen;
+			last unless $dlen;
+			
+			my ($id, $datalen) = $dlen > 0 ? unpack('@'.$pos.'ww', $$rbuf) : (PROTO_EVENT_IDS);
+			my $route = $id < PROTO_EVENT_IDS && $mine->{routes}[$id];
+			unless ($route) {
+				DEBUG && warn "Bad event id";
+				_cb_error($handle, 1, 'Bad event id');
+				return;
+			}
+			$pos += $ilen + $dlen;
+			
+			$mine->{event} = $self->{event_names}[$route->[0]];
+			$mine->{route} = $route;
+			$mine->{datalen} = $datalen;
+			$mine->{state} = PROTO_DATA_RCV;
+			$mine->{first} = 1;
+			redo;
 		}
 
 =head2 Event data receiving
@@ -319,28 +670,38 @@ Special arguments state:
 
 =back
 
-Event data will be resent to all subscribers except sender.
+Event data will be resent to all subscribers except sender
+and to one member of each queue group.
 
 =cut
-		when (PROTO_DATA_RCV) {
+		elsif ($state == PROTO_DATA_RCV) {
 			my @specvars;
-
-			if (!$handle->{_mine}{datalen}) {
-				$handle->{_mine}{datalen} = unpack('Q', _strshift($handle->{rbuf}, 8));
-				push @specvars, $handle->{_mine}{event}, $handle->{_mine}{datalen};
+			
+			if (delete $mine->{first}) {
+				# length already received with compact event
+				push @specvars, $mine->{event}, $mine->{datalen};
+			}
+			elsif (!$mine->{datalen}) {
+				last if $len - $pos < 8;
+				
+				$mine->{datalen} = unpack('@'.$pos.'Q', $$rbuf);
+				$pos += 8;
+				push @specvars, $mine->{event}, $mine->{datalen};
 			}
 			else {
 				push @specvars, undef, undef;
 			}
 			
-			if ($handle->{_mine}{datalen} == 0) {
+			if ($mine->{datalen} == 0) {
 				push @specvars, '';
+				$mine->{state} = PROTO_WAITING;
 			}
-			elsif ((my $buflen = length($handle->{rbuf})) > 0) {
-				my $bytes = $buflen > $handle->{_mine}{datalen} ? $handle->{_mine}{datalen} : $buflen;
-				push @specvars, _strshift($handle->{rbuf}, $bytes);
-				unless ($handle->{_mine}{datalen} -= $bytes) {
-					$handle->{_mine}{state} = PROTO_WAITING; # all data received
+			elsif ((my $buflen = $len - $pos) > 0) {
+				my $bytes = $buflen > $mine->{datalen} ? $mine->{datalen} : $buflen;
+				push @specvars, substr($$rbuf, $pos, $bytes);
+				$pos += $bytes;
+				unless ($mine->{datalen} -= $bytes) {
+					$mine->{state} = PROTO_WAITING; # all data received
 				}
 			}
 			else {
@@ -349,30 +710,80 @@ Event data will be resent to all subscribers except sender.
 			
 			DEBUG && warn "PROTO_DATA_RCV: ", join('|', @specvars);
 			_resend_event($handle, @specvars);
+			_remember($handle, @specvars) if %{$self->{lv_events}};
 			_do_actions($handle, @specvars);
 		}
+		else {
+			DEBUG && warn "Unexpected protocol operation: $state";
+			_cb_error($handle, 1, 'Unexpected protocol operation');
+			return;
+		}
 	}
+	
+	substr($$rbuf, 0, $pos, '') if $pos;
 }
 
 sub _cb_error {
 	my ($handle, $fatal, $message) = @_;
 	DEBUG && warn "_cb_error($handle, $fatal, $message)";
 	
-	if ($self->{handles}{_$handle} != $handle) {
-		my $key = $self->{handles}{_$handle};
-		delete $self->{waiting}{$key}{_$handle};
-		
-		unless (%{$self->{waiting}{$key}}) {
-			delete $self->{waiting}{$key};
-		}
-	}
-	
+	_unsubscribe($handle, $_) for keys %{$handle->{_mine}{subs}};
+	_leave_group($handle, @$_) for values %{$handle->{_mine}{groups}};
+	close(delete $handle->{_mine}{spill_fh}) if $handle->{_mine}{spill_fh};
 	delete $self->{handles}{_$handle};
 	$handle->destroy();
 	undef $handle;
 }
 
+# handle wrote everything, so give it the next part of the queue
+sub _cb_drain {
+	my ($handle) = @_;
+	my $mine = $handle->{_mine};
+	
+	# push_write() calls us again when data is written immediately
+	return if $mine->{draining};
+	local $mine->{draining} = 1;
+	
+	while (!length($handle->{wbuf}) && !$handle->destroyed) {
+		unless (length $mine->{oq}) {
+			last if $mine->{spill_rd} == $mine->{spill_wr};
+			
+			# queue continues on the disk
+			sysseek($mine->{spill_fh}, $mine->{spill_rd}, 0);
+			my $n = sysread($mine->{spill_fh}, $mine->{oq}, OUT_CHUNK);
+			unless ($n) {
+				warn "spill: ", defined $n ? 'unexpected end of file' : $!;
+				_cb_error($handle, 1, 'Could not read spilled queue');
+				return;
+			}
+			
+			$mine->{spill_rd} += $n;
+			if ($mine->{spill_rd} == $mine->{spill_wr}) {
+				truncate($mine->{spill_fh}, 0);
+				$mine->{spill_rd} = $mine->{spill_wr} = 0;
+			}
+		}
+		
+		my $chunk = substr($mine->{oq}, 0, OUT_CHUNK, '');
+		$mine->{qpos} += length $chunk;
+		$handle->push_write($chunk);
+	}
+}
+
 #### other routines ####
+sub _hello($$) {
+	my ($mine, $event) = @_;
+	
+	return unless length($event) == 10 && substr($event, 0, 5) eq PROTO_HELLO_MAGIC;
+	
+	my ($version, $caps) = unpack('x5CN', $event);
+	DEBUG && warn "PROTO_HELLO: $version, $caps";
+	$mine->{version} = $version < PROTO_VERSION ? $version : PROTO_VERSION;
+	$mine->{caps} = $caps & PROTO_CAPS;
+	
+	return pack('CCN', PROTO_HELLO, PROTO_VERSION, PROTO_CAPS);
+}
+
 sub _can_auth($$$) {
 	my ($host, $login, $password) = @_;
 	DEBUG && warn "_can_auth($host, $login, $password)";
@@ -391,124 +802,523 @@ sub _can_auth($$$) {
 		return 0;
 	}
 	
-	if (exists $self->{cfg}{hosts}{optimized}{ip}{$host}) {
-		# auth by ip ok
-		return 1;
+	# auth by ip
+	return $self->{cfg}{hosts}->allowed($host) ? 1 : 0;
+}
+
+sub _resend_event($@) {
+	my $handle = shift;
+	
+	# frame is serialized once and shared by all subscribers
+	my $frame = '';
+	if (defined $_[0]) { # event
+		$frame .= pack('CCa*', PROTO_EVENT_SND, length($_[0]), $_[0]);
+	}
+	
+	if (defined $_[1]) { # datalen
+		$frame .= pack('CQ', PROTO_DATA_SND, $_[1]);
+	}
+	
+	if (defined $_[2]) { # data
+		$frame .= $_[2];
+	}
+	
+	return if $frame eq '';
+	
+	# subscribers which support compact event get it in one frame
+	my ($compact, $by_id) = ($frame);
+	my $data = defined $_[2] ? $_[2] : '';
+	if (defined $_[0]) {
+		$compact = pack('CC/a*w', PROTO_EVENT_DATA_SND, $_[0], $_[1]) . $data;
 	}
 	
-	my $netmask = $self->{cfg}{hosts}{optimized}{netmask};
-	for (my $i=0, my $l=@$netmask; $i<$l; $i+=2) {
-		if (ip_belongs_net($host, $netmask->[$i], $netmask->[$i+1])) {
-			return 1;
+	my $mine = $handle->{_mine};
+	my $first = defined $_[1];
+	my @keys;
+	if ($first) {
+		$mine->{skip} = {} if %{$mine->{skip}};
+	}
+	
+	my $route = _route($handle);
+	my @w_handles = map { $_ ? values %$_ : () } @$route[2, 3]; # ip + event, any_ip + event
+	push @w_handles, _group_picks($handle, $route, $first) if $route->[4] || $route->[5];
+	
+	foreach my $w_handle (@w_handles) {
+		next if $w_handle == $handle || $w_handle->destroyed;
+		
+		my $w_mine = $w_handle->{_mine};
+		my $conflate;
+		if ($first) {
+			if (%{$w_mine->{conflate}}) {
+				# subscription, which matched the event, could conflate it
+				@keys = (pack('Na*', $mine->{host}, $mine->{event}), "\0\0\0\0" . $mine->{event}) unless @keys;
+				($conflate) = grep { $w_mine->{conflate}{$_} } @keys;
+			}
+			
+			# whole message is accepted or not by the queue of the client
+			unless (_admit($w_handle, length($frame) - length($data) + $_[1], $conflate)) {
+				$mine->{skip}{_$w_handle} = 1;
+				next;
+			}
+		}
+		elsif (%{$mine->{skip}} && $mine->{skip}{_$w_handle}) {
+			next;
+		}
+		
+		my $sent;
+		if (defined $_[0] && $w_mine->{caps} & PROTO_CAP_EVENT_ID) {
+			# event sent by name gets its id only when it is needed
+			my $gid = $route->[0] //= _intern($_[0]);
+			
+			if ($gid < PROTO_EVENT_IDS) {
+				unless ($w_mine->{out_ids}[$gid]++) {
+					# client should get the definition, so the message is never dropped
+					$w_mine->{marks}[-1][1] = 1 if $first && @{$w_mine->{marks}};
+					_push($w_handle, pack('CwC/a*', PROTO_EVENT_DEF, $gid, $_[0]));
+				}
+				_push($w_handle, $by_id //= pack('Cww', PROTO_EVENT_ID_DATA_SND, $gid, $_[1]) . $data);
+				$sent = 1;
+			}
+		}
+		
+		_push($w_handle, $w_mine->{caps} & PROTO_CAP_COMPACT ? $compact : $frame) unless $sent;
+		
+		if (defined $conflate && !$w_handle->destroyed) {
+			# the rest of the data will follow, so the end is known now
+			$w_mine->{marks}[-1][3] = _tail($w_handle) + $_[1] - length $data;
 		}
 	}
+}
+
+# bytes queued for the client, in memory and on the disk
+sub _depth($) {
+	my ($handle) = @_;
+	my $mine = $handle->{_mine};
 	
-	return 0;
+	return length($handle->{wbuf}) + length($mine->{oq}) + $mine->{spill_wr} - $mine->{spill_rd};
 }
 
-sub _resend_event($@) {
-	my $handle = shift;
+# stream position after the last queued byte
+sub _tail($) {
+	my $mine = $_[0]{_mine};
 	
-	foreach my $key (
-		pack('Na*', $handle->{_mine}{host}, $handle->{_mine}{event}), # ip + event
-		"\0\0\0\0" . $handle->{_mine}{event}                          # any_ip + event
-	) {
-		if (exists $self->{waiting}{$key}) {
-			while (my (undef, $w_handle) = each %{$self->{waiting}{$key}}) {
-				if ($w_handle != $handle) {
-					if (defined $_[0]) { # event
-						$w_handle->push_write(pack('CCa*', PROTO_EVENT_SND, length($_[0]), $_[0]));
-					}
-					
-					if (defined $_[1]) { # datalen
-						$w_handle->push_write(pack('CQ', PROTO_DATA_SND, $_[1]));
-					}
-					
-					if (defined $_[2]) { # data
-						$w_handle->push_write($_[2]);
-					}
-				}
-			}
+	return $mine->{qpos} + length($mine->{oq}) + $mine->{spill_wr} - $mine->{spill_rd};
+}
+
+# decides if the message of the size could be queued for the client according
+# to out_queue_policy, message bigger than the limit is accepted by empty queue
+# key is the conflated subscription which matched the message
+sub _admit($$;$) {
+	my ($handle, $size, $key) = @_;
+	my $mine = $handle->{_mine};
+	my $cfg = $self->{cfg}{main}{data};
+	my $limit = $cfg->{out_queue_limit};
+	
+	_conflate($handle, $key) if defined $key;
+	my $depth = _depth($handle);
+	
+	if ($limit && $depth && $depth + $size > $limit && $cfg->{out_queue_policy} ne 'spill') {
+		if ($cfg->{out_queue_policy} eq 'disconnect') {
+			DEBUG && warn "Output queue limit exceeded: $depth";
+			_cb_error($handle, 1, 'Output queue limit exceeded');
+			return 0;
+		}
+		
+		if ($cfg->{out_queue_policy} eq 'drop_oldest') {
+			_evict($handle, $depth + $size - $limit);
+		}
+		
+		unless ($cfg->{out_queue_policy} eq 'drop_oldest' && _depth($handle) + $size <= $limit) {
+			$mine->{dropped}++;
+			return 0;
 		}
 	}
+	
+	if ($cfg->{out_queue_policy} eq 'drop_oldest' || defined $key) {
+		# where messages start, to drop them as a whole
+		my $marks = $mine->{marks};
+		shift @$marks while @$marks && $marks->[0][0] < $mine->{qpos};
+		push @$marks, [_tail($handle), 0, $key // '', 0];
+	}
+	
+	return 1;
 }
 
-sub _do_actions($@) {
-	my $handle = shift;
+# drops oldest messages which were not given to the handle yet, at least
+# bytes if possible. The newest one is kept, because its data could still come,
+# and pinned ones, because they define event ids
+sub _evict($$) {
+	my ($handle, $bytes) = @_;
+	my $mine = $handle->{_mine};
+	my $marks = $mine->{marks};
+	
+	shift @$marks while @$marks && $marks->[0][0] < $mine->{qpos};
+	
+	my $i = 0;
+	$i++ while $i < $#$marks && $marks->[$i][1];
+	return if $i >= $#$marks;
+	
+	my $n = $i + 1;
+	$n++ while $n < $#$marks && !$marks->[$n][1] && $marks->[$n][0] - $marks->[$i][0] < $bytes;
 	
-	my @actions_array;
-	if (my $act_sender = $self->{cfg}{actions}{optimized}{senders}{$handle->{_mine}{host}}) {
-		push @actions_array, [@$act_sender];
+	_cut($handle, $i, $n, $marks->[$n][0] - $marks->[$i][0]);
+	$mine->{dropped} += $n - $i;
+}
+
+# removes the previous message of the conflated subscription if it was
+# not given to the handle yet, so the new one replaces it
+sub _conflate($$) {
+	my ($handle, $key) = @_;
+	my $mine = $handle->{_mine};
+	my $marks = $mine->{marks};
+	
+	my $i = $#$marks;
+	$i-- while $i >= 0 && $marks->[$i][2] ne $key;
+	return if $i < 0;
+	
+	# it should be complete and in memory
+	my $mark = $marks->[$i];
+	return if $mark->[1] || !$mark->[3] || $mark->[0] < $mine->{qpos} ||
+	          $mark->[3] > $mine->{qpos} + length $mine->{oq};
+	
+	_cut($handle, $i, $i + 1, $mark->[3] - $mark->[0]);
+	$mine->{conflated}++;
+}
+
+# removes queued messages from i to n, len bytes from the start of the first one
+# queued bytes before them move to their place
+sub _cut($$$$) {
+	my ($handle, $i, $n, $len) = @_;
+	my $mine = $handle->{_mine};
+	my $marks = $mine->{marks};
+	
+	substr($mine->{oq}, $marks->[$i][0] - $mine->{qpos}, $len, '');
+	$mine->{qpos} += $len;
+	foreach my $mark (@$marks[0 .. $i-1]) {
+		$mark->[0] += $len;
+		$mark->[3] += $len if $mark->[3];
 	}
-	if (my $act_user = $self->{cfg}{actions}{optimized}{users}{$handle->{_mine}{user}}) {
-		push @actions_array, [@$act_user];
+	splice(@$marks, $i, $n - $i);
+}
+
+# queues bytes for the client. Handle gets them only when it wrote all it has
+# (see _cb_drain), so queued messages could be dropped or spilled to the disk
+sub _push($$) {
+	my ($handle, $bytes) = @_;
+	my $mine = $handle->{_mine};
+	
+	if (!length($handle->{wbuf}) && !length($mine->{oq}) && $mine->{spill_rd} == $mine->{spill_wr}) {
+		# nothing is queued, so write right now
+		$mine->{qpos} += length $bytes;
+		$handle->push_write($bytes);
+		return;
 	}
-	if (my $act_event = $self->{cfg}{actions}{optimized}{events}{$handle->{_mine}{event}}) {
-		push @actions_array, [@$act_event];
+	
+	my $cfg = $self->{cfg}{main}{data};
+	if ($cfg->{out_queue_policy} eq 'spill' && $cfg->{out_queue_limit} &&
+	    ($mine->{spill_rd} != $mine->{spill_wr} || length($mine->{oq}) + length($bytes) > $cfg->{out_queue_limit})) {
+		# queued data is always older than spilled one
+		return _spill($handle, $bytes);
 	}
-	my $netmask = $self->{cfg}{actions}{optimized}{netmask};
 	
-	my @acting;
-	my ($i, $j) = (0, 0);
-	foreach my $actions (@actions_array) {
-		foreach my $action (@$actions) {
-			my $cond = $action->{condcnt} - 1;
-			for ($j=$i; $cond>0, $j<@actions_array; $j++) {
-				if ((my $index = _arrindex($actions_array[$j], $action)) != -1) {
-					$cond--;
-					splice @{$actions_array[$j]}, $index, 1; # delete used action
-				}
-			}
+	$mine->{oq} .= $bytes;
+	my $depth = _depth($handle);
+	$mine->{peak} = $depth if $depth > $mine->{peak};
+}
+
+sub _spill($$) {
+	my ($handle, $bytes) = @_;
+	my $mine = $handle->{_mine};
+	
+	unless ($mine->{spill_fh}) {
+		# nobody else needs the file, so it is removed at once
+		my $path;
+		eval {
+			($mine->{spill_fh}, $path) = File::Temp::tempfile(
+				'mine-spill-XXXXXX',
+				DIR => $self->{cfg}{main}{data}{spill_path} || File::Spec->tmpdir
+			);
+		};
+		if ($@) {
+			warn "spill: $@";
+			_cb_error($handle, 1, 'Could not spill output queue');
+			return;
+		}
+		unlink $path;
+		binmode $mine->{spill_fh};
+	}
+	
+	sysseek($mine->{spill_fh}, $mine->{spill_wr}, 0);
+	my $n = syswrite($mine->{spill_fh}, $bytes);
+	unless (defined($n) && $n == length $bytes) {
+		warn "spill: ", defined $n ? 'short write' : $!;
+		_cb_error($handle, 1, 'Could not spill output queue');
+		return;
+	}
+	
+	$mine->{spill_wr} += $n;
+	$mine->{spilled} += $n;
+	my $depth = _depth($handle);
+	$mine->{peak} = $depth if $depth > $mine->{peak};
+}
+
+# members of queue groups which get the current message of the connection
+# chosen on the first chunk of the data and remembered for the rest
+sub _group_picks($$$) {
+	my ($handle, $route, $first) = @_;
+	my $mine = $handle->{_mine};
+	
+	unless ($first) {
+		# member could leave in the middle of the data
+		return map { exists $_->[0]{idx}{_$_->[1]} ? $_->[1] : () } @{$mine->{picks}};
+	}
+	
+	my @picks;
+	foreach my $groups (@$route[4, 5]) {
+		next unless $groups;
+		
+		foreach my $group (values %$groups) {
+			# sticky group keeps publisher on the same member, otherwise member
+			# with the shortest output queue is chosen, starting from the next
+			# one to distribute messages between equally loaded members
+			my $members = $group->{members};
+			my $start = $group->{sticky} ? $mine->{id} : $group->{rr}++;
+			my ($best, $min);
 			
-			if ($cond > 0) {
-				for ($j=0; $j<@$netmask; $j+=3) {
-					if ($action == $netmask->[$j+2] &&
-						ip_belongs_net($handle->{_mine}{host}, $netmask->[$j], $netmask->[$j+1])) {
-						$cond--;
-						last;
-					}
+			for (my $i=0; $i<@$members; $i++) {
+				my $w_handle = $members->[($start + $i) % @$members];
+				next if $w_handle == $handle;
+				
+				my $depth = _depth($w_handle);
+				if ($group->{sticky} || !$depth) {
+					$best = $w_handle;
+					last;
 				}
+				($best, $min) = ($w_handle, $depth) if !defined($min) || $depth < $min;
 			}
 			
-			if ($cond <= 0) {
-				push @acting, $action->{action};
-			}
+			push @picks, [$group, $best] if $best;
 		}
-		
-		$i++;
 	}
 	
-	foreach my $act (@acting, @{$self->{cfg}{actions}{optimized}{actions}}) {
+	$mine->{picks} = \@picks;
+	return map { $_->[1] } @picks;
+}
+
+sub _do_actions($@) {
+	my $handle = shift;
+	my $mine = $handle->{_mine};
+	
+	if (defined $_[0]) {
+		# first chunk of the event data, actions
+		# will be the same for the rest chunks
+		$mine->{actions} = $self->{cfg}{actions}->match($mine->{host}, $mine->{user}, $mine->{event});
+	}
+	
+	foreach my $act (@{$mine->{actions}}) {
 		foreach my $act_elt (@$act) {
-			$self->{plugins}->act($handle->{_mine}{stash}, $act_elt, @_);
+			$self->{plugins}->act($mine->{stash}, $act_elt, @_);
 		}
 	}
 }
 
-sub _($) {
-	substr($_[0], 22, -1);
+# key is ip + event, returns true if handle was not subscribed yet
+sub _subscribe($$;$) {
+	my ($handle, $key, $conflate) = @_;
+	my $new = !$handle->{_mine}{subs}{$key};
+	
+	$self->{waiting_gen}++ unless exists $self->{waiting}{$key};
+	$self->{waiting}{$key}{_$handle} = $handle;
+	$handle->{_mine}{subs}{$key} = 1;
+	
+	# flags of the last registration are used
+	if ($conflate) {
+		$handle->{_mine}{conflate}{$key} = 1;
+	}
+	else {
+		delete $handle->{_mine}{conflate}{$key};
+	}
+	
+	return $new;
 }
 
-sub _strshift($$) {
-	my $rv = substr($_[0], 0, defined($_[1]) ? $_[1] : 1)
-		if defined wantarray();
+sub _unsubscribe($$) {
+	my ($handle, $key) = @_;
+	
+	return unless delete $handle->{_mine}{subs}{$key};
+	delete $handle->{_mine}{conflate}{$key};
+	delete $self->{waiting}{$key}{_$handle};
+	
+	unless (%{$self->{waiting}{$key}}) {
+		delete $self->{waiting}{$key};
+		$self->{waiting_gen}++;
+	}
+}
+
+# keeps the last complete message of the event, which last value is cached,
+# to replay it to new subscribers. Message is collected while its data comes
+sub _remember($@) {
+	my $handle = shift;
+	my $mine = $handle->{_mine};
+	my $cfg = $self->{cfg}{main}{data};
+	
+	if (defined $_[1]) { # first chunk
+		delete $mine->{lv};
+		return unless $self->{lv_events}{$_[0]};
 		
-	substr($_[0], 0, defined($_[1]) ? $_[1] : 1) = '';
-	$rv;
+		if ($_[1] > $cfg->{last_value_size}) {
+			# cached value is not the last one anymore
+			_forget($_[0], pack('N', $mine->{host}));
+			return;
+		}
+		
+		$mine->{lv} = '';
+	}
+	
+	return unless defined $mine->{lv};
+	$mine->{lv} .= $_[2] if defined $_[2];
+	return if $mine->{datalen}; # more data will come
+	
+	my ($event, $ip, $seq) = ($mine->{event}, pack('N', $mine->{host}), ++$self->{lv_seq});
+	_forget($event, $ip);
+	$self->{lv}{$event}{$ip} = [delete $mine->{lv}, $seq];
+	$self->{lv_bytes} += length $self->{lv}{$event}{$ip}[0];
+	$self->{lv_count}++;
+	
+	my $lru = $self->{lv_lru};
+	push @$lru, [$event, $ip, $seq];
+	
+	# least recently updated values are dropped first
+	while ($self->{lv_bytes} > $cfg->{last_value_limit} && @$lru) {
+		my $old = shift @$lru;
+		_forget(@$old) if _lv_current($old);
+	}
+	
+	# replaced values remain in the order, so it is cleaned sometimes
+	@$lru = grep { _lv_current($_) } @$lru if @$lru > 2 * $self->{lv_count} + 64;
 }
 
-sub _arrindex($$) {
-	my ($array, $elt) = @_;
+# is [event, ip, seq] from lv_lru still in the cache
+sub _lv_current($) {
+	my ($event, $ip, $seq) = @{$_[0]};
+	my $values = $self->{lv}{$event};
 	
-	my $i = 0;
-	foreach my $e (@$array) {
-		if ($e eq $elt) {
-			return $i;
+	return $values && $values->{$ip} && $values->{$ip}[1] == $seq;
+}
+
+sub _forget($$) {
+	my ($event, $ip) = @_;
+	my $values = $self->{lv}{$event} or return;
+	my $value = delete $values->{$ip} or return;
+	
+	delete $self->{lv}{$event} unless %$values;
+	$self->{lv_bytes} -= length $value->[0];
+	$self->{lv_count}--;
+}
+
+# sends cached last values of the event to the subscriber, key is ip + event
+sub _replay($$) {
+	my ($handle, $key) = @_;
+	my ($ip, $event) = unpack('a4a*', $key);
+	my $values = $self->{lv}{$event} or return;
+	my $mine = $handle->{_mine};
+	
+	foreach my $value ($ip eq "\0\0\0\0" ? values %$values : $values->{$ip} || ()) {
+		my $frame = $mine->{caps} & PROTO_CAP_COMPACT ?
+			pack('CC/a*w', PROTO_EVENT_DATA_SND, $event, length $value->[0]) :
+			pack('CC/a*CQ', PROTO_EVENT_SND, $event, PROTO_DATA_SND, length $value->[0]);
+		
+		_push($handle, $frame . $value->[0]) if _admit($handle, length($frame) + length($value->[0]));
+		last if $handle->destroyed;
+	}
+}
+
+# key is ip + event, members are kept in array to choose them by index
+sub _join_group($$$$) {
+	my ($handle, $key, $name, $sticky) = @_;
+	
+	unless (exists $self->{groups}{$key}) {
+		$self->{groups}{$key} = {};
+		$self->{waiting_gen}++;
+	}
+	
+	my $group = $self->{groups}{$key}{$name} ||= {sticky => $sticky, members => [], idx => {}, rr => 0};
+	return if exists $group->{idx}{_$handle};
+	
+	push @{$group->{members}}, $handle;
+	$group->{idx}{_$handle} = $#{$group->{members}};
+	$handle->{_mine}{groups}{pack('C/a*a*', $name, $key)} = [$key, $name];
+}
+
+sub _leave_group($$$) {
+	my ($handle, $key, $name) = @_;
+	
+	return unless delete $handle->{_mine}{groups}{pack('C/a*a*', $name, $key)};
+	my $group = $self->{groups}{$key}{$name};
+	my $members = $group->{members};
+	
+	# last member takes place of the leaving one
+	my $i = delete $group->{idx}{_$handle};
+	my $last = pop @$members;
+	if ($i < @$members) {
+		$members->[$i] = $last;
+		$group->{idx}{_$last} = $i;
+	}
+	
+	unless (@$members) {
+		delete $self->{groups}{$key}{$name};
+		
+		unless (%{$self->{groups}{$key}}) {
+			delete $self->{groups}{$key};
+			$self->{waiting_gen}++;
 		}
-		$i++;
 	}
+}
+
+# name of the event interned to id, same for all connections
+sub _intern($) {
+	my $event = shift;
 	
-	return -1;
+	unless (exists $self->{event_ids}{$event}) {
+		push @{$self->{event_names}}, $event;
+		$self->{event_ids}{$event} = $#{$self->{event_names}};
+	}
+	
+	return $self->{event_ids}{$event};
+}
+
+# subscribers of the current event of the connection
+sub _route($) {
+	my $mine = $_[0]{_mine};
+	my $route = $mine->{route};
+	
+	if ($route->[1] != $self->{waiting_gen}) {
+		my $event = $mine->{event};
+		my ($ip_key, $any_key) = (pack('Na*', $mine->{host}, $event), "\0\0\0\0" . $event);
+		@$route[1 .. 5] = (
+			$self->{waiting_gen},
+			$self->{waiting}{$ip_key},
+			$self->{waiting}{$any_key},
+			$self->{groups}{$ip_key},
+			$self->{groups}{$any_key}
+		);
+	}
+	
+	return $route;
+}
+
+# length of the BER compressed integer at the position of the buffer
+# 0 if it is incomplete, -1 if it is too long
+sub _ber_len($$) {
+	my ($rbuf, $pos) = @_;
+	
+	# last byte has no high bit
+	return $+[0] if substr($$rbuf, $pos, 10) =~ /^[\x80-\xff]*[\x00-\x7f]/;
+	return length($$rbuf) - $pos < 10 ? 0 : -1;
+}
+
+sub _($) {
+	substr($_[0], 22, -1);
 }
 
 1;
@@ -0,0 +1,101 @@
+package Mine::Utils::IPTrie;
+
+use strict;
+
+=head1 NAME
+
+Mine::Utils::IPTrie - binary trie to search networks which ip belongs to
+
+=head1 SYNOPSIS
+
+	my $trie = Mine::Utils::IPTrie->new();
+	$trie->add(host2long('10.0.0.0'), cidr2long(8), 'ten');
+	$trie->lookup(host2long('10.1.2.3')); # ten
+
+=cut
+
+=head2 new()
+
+Creates new empty trie
+
+=cut
+
+sub new {
+	my ($class) = @_;
+	
+	# node is [child for 0 bit, child for 1 bit, values]
+	my $self = {root => [], size => 0};
+	bless $self, $class;
+}
+
+=head2 add($net, $mask, $value)
+
+Adds network with specified mask (both as unsigned long) and value associated with it.
+Several values could be associated with the same network.
+
+=cut
+
+sub add {
+	my ($self, $net, $mask, $value) = @_;
+	
+	my $bits = unpack('%32b*', pack('N', $mask));
+	my $node = $self->{root};
+	for (my $bit=31; $bit>31-$bits; $bit--) {
+		$node = $node->[($net >> $bit) & 1] ||= [];
+	}
+	
+	push @{$node->[2]}, $value;
+	$self->{size}++;
+}
+
+=head2 lookup($ip)
+
+Returns first value of the longest network which ip belongs to. Undef if there is no such
+network. At most 32 steps regardless of trie size.
+
+=cut
+
+sub lookup {
+	my ($self, $ip) = @_;
+	
+	my ($node, $found) = ($self->{root});
+	for (my $bit=31; $node; $bit--) {
+		$found = $node->[2] if $node->[2];
+		last if $bit < 0;
+		$node = $node->[($ip >> $bit) & 1];
+	}
+	
+	return $found ? $found->[0] : undef;
+}
+
+=head2 lookup_all($ip)
+
+Returns list of all values of all networks which ip belongs to.
+
+=cut
+
+sub lookup_all {
+	my ($self, $ip) = @_;
+	
+	my @values;
+	my $node = $self->{root};
+	for (my $bit=31; $node; $bit--) {
+		push @values, @{$node->[2]} if $node->[2];
+		last if $bit < 0;
+		$node = $node->[($ip >> $bit) & 1];
+	}
+	
+	return @values;
+}
+
+=head2 size()
+
+Returns number of networks in the trie
+
+=cut
+
+sub size {
+	$_[0]{size};
+}
+
+1;
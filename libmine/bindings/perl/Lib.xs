@@ -12,6 +12,9 @@ typedef struct {
 
 #define P_TO_MINE_LIB(object, context) p_to_mine_lib(aTHX_ object, context)
 
+// in non-blocking mode EAGAIN is not an error, so autodie should not croak
+#define MINE_LIB_DIE(self) (self->autodie && !(self->mine->nonblock && self->mine->err == EAGAIN))
+
 static MINE_LIB* p_to_mine_lib(pTHX_ SV *object, const char *context) {
 	SV *sv;
 	IV address;
@@ -47,6 +50,9 @@ new(char* class, ...)
 			if (strEQ( SvPV_nolen(ST(i)), "autodie" )) {
 				self->autodie = SvIV(ST(i+1));
 			}
+			else if (strEQ( SvPV_nolen(ST(i)), "nonblock" )) {
+				mine_set_nonblock(self->mine, SvIV(ST(i+1)));
+			}
 			// other options here
 			else {
 				croak("Unsupported option: %s", SvPV_nolen(ST(i)));
@@ -70,7 +76,17 @@ int
 connect(MINE_LIB *self, char *host, int port)
 	CODE:
 		RETVAL = mine_connect(self->mine, host, port);
-		if (RETVAL == 0 && self->autodie) {
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+connect_unix(MINE_LIB *self, char *path)
+	CODE:
+		RETVAL = mine_connect_unix(self->mine, path);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
@@ -80,7 +96,7 @@ int
 disconnect(MINE_LIB *self)
 	CODE:
 		RETVAL = mine_disconnect(self->mine);
-		if (RETVAL == 0 && self->autodie) {
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
@@ -90,7 +106,7 @@ int
 login(MINE_LIB *self, char *login, char *password)
 	CODE:
 		RETVAL = mine_login(self->mine, login, password);
-		if (RETVAL == 0 && self->autodie) {
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
@@ -100,19 +116,123 @@ int
 event_reg(MINE_LIB *self, char *event, char *ip)
 	CODE:
 		RETVAL = mine_event_reg(self->mine, event, ip);
-		if (RETVAL == 0 && self->autodie) {
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
 		RETVAL
 
+int
+event_reg_multi(MINE_LIB *self, char *ip, ...)
+	INIT:
+		char **events;
+		size_t n = items - 2;
+		I32 i;
+	CODE:
+		Newx(events, n ? n : 1, char*);
+		for (i=0; i<n; i++) {
+			events[i] = SvPV_nolen(ST(2+i));
+		}
+		
+		RETVAL = mine_event_reg_multi(self->mine, events, n, ip);
+		Safefree(events);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_unreg(MINE_LIB *self, char *event, char *ip)
+	CODE:
+		RETVAL = mine_event_unreg(self->mine, event, ip);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_reg_group(MINE_LIB *self, char *event, char *ip, char *group, int flags = 0)
+	CODE:
+		RETVAL = mine_event_reg_group(self->mine, event, ip, group, flags);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_reg_flags(MINE_LIB *self, char *event, char *ip, int flags)
+	CODE:
+		RETVAL = mine_event_reg_flags(self->mine, event, ip, flags);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_reg_from(MINE_LIB *self, char *event, char *ip, UV seq = 0)
+	CODE:
+		RETVAL = mine_event_reg_from(self->mine, event, ip, seq);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+UV
+rcv_seq(MINE_LIB *self)
+	CODE:
+		RETVAL = self->mine->rcv_seq;
+	OUTPUT:
+		RETVAL
+
 int
 event_send(MINE_LIB *self, char *event, int datalen, SV *data)
 	CODE:
 		STRLEN chunk_len;
 		char *data_ptr = SvPV(data, chunk_len);
 		RETVAL = mine_event_send(self->mine, event, datalen, chunk_len, data_ptr);
-		if (RETVAL == 0 && self->autodie) {
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_send_batch(MINE_LIB *self, ...)
+	INIT:
+		if (items % 2 == 0)
+			croak("Odd number of elements in events");
+		
+		MINE_MSG *msgs;
+		size_t n = (items-1) / 2;
+		I32 i;
+	CODE:
+		// pairs of event and data
+		Newx(msgs, n ? n : 1, MINE_MSG);
+		for (i=0; i<n; i++) {
+			STRLEN len;
+			msgs[i].event = SvPV_nolen(ST(1+i*2));
+			msgs[i].data = SvPV(ST(2+i*2), len);
+			msgs[i].datalen = len;
+		}
+		
+		RETVAL = mine_event_send_batch(self->mine, msgs, n);
+		Safefree(msgs);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+event_send_fd(MINE_LIB *self, char *event, int fd, IV off, IV len)
+	CODE:
+		RETVAL = mine_event_send_fd(self->mine, event, fd, off, len);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
@@ -140,7 +260,65 @@ event_recv(MINE_LIB *self, SV *event, SV *datalen, SV *buf)
 			sv_setpvn_mg(SvRV(buf), bf, RETVAL);
 		}
 		
-		if (RETVAL == -1 && self->autodie) {
+		if (RETVAL == -1 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+IV
+event_recv_to_fd(MINE_LIB *self, SV *event, SV *datalen, int fd)
+	INIT:
+		if (!SvROK(event))
+			croak("event should be a reference to scalar");
+		
+		if (!SvROK(datalen))
+			croak("datalen should be a reference to scalar");
+		
+		char *ev;
+		int64_t dlen;
+	CODE:
+		RETVAL = mine_event_recv_to_fd(self->mine, &ev, &dlen, fd);
+		if (RETVAL >= 0) {
+			sv_setpv_mg(SvRV(event), ev);
+			sv_setiv_mg(SvRV(datalen), dlen);
+		}
+		
+		if (RETVAL == -1 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+fd(MINE_LIB *self)
+	CODE:
+		RETVAL = mine_fd(self->mine);
+	OUTPUT:
+		RETVAL
+
+int
+wants(MINE_LIB *self)
+	CODE:
+		RETVAL = mine_wants(self->mine);
+	OUTPUT:
+		RETVAL
+
+int
+flush(MINE_LIB *self)
+	CODE:
+		RETVAL = mine_flush(self->mine);
+		if (RETVAL == 0 && MINE_LIB_DIE(self)) {
+			croak(self->mine->errstr);
+		}
+	OUTPUT:
+		RETVAL
+
+int
+nonblock(MINE_LIB *self, ...)
+	CODE:
+		RETVAL = self->mine->nonblock;
+		if (items > 1 && !mine_set_nonblock(self->mine, SvIV(ST(1))) && self->autodie) {
 			croak(self->mine->errstr);
 		}
 	OUTPUT:
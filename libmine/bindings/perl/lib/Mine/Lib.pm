@@ -16,17 +16,30 @@ our @ISA = qw(Exporter);
 # If you do not need this, moving things directly into @EXPORT or @EXPORT_OK
 # will save memory.
 our %EXPORT_TAGS = ( 'all' => [ qw(
-	
+	MINE_WANT_READ
+	MINE_WANT_WRITE
+	MINE_GROUP_STICKY
+	MINE_GROUP_LEAVE
+	MINE_REG_CONFLATE
 ) ] );
 
 our @EXPORT_OK = ( @{ $EXPORT_TAGS{'all'} } );
 
 our @EXPORT = qw(
-	
+
 );
 
 our $VERSION = '0.01';
 
+# mirrors libmine mine.h, see wants(), event_reg_group() and event_reg_flags()
+use constant {
+	MINE_WANT_READ    => 1,
+	MINE_WANT_WRITE   => 2,
+	MINE_GROUP_STICKY => 1,
+	MINE_GROUP_LEAVE  => 2,
+	MINE_REG_CONFLATE => 1,
+};
+
 require XSLoader;
 XSLoader::load('Mine::Lib', $VERSION);
 
@@ -1,5 +1,7 @@
 #include "mine.h"
 
+static MINE_CTX *MINE_DEFAULT_CTX = NULL;
+
 void _mine_set_sys_error(MINE *self) {
 	self->err  = errno;
 	self->errstr = strerror(errno);
@@ -25,323 +27,1848 @@ void _mine_set_error(MINE *self) {
 	}
 }
 
+void _mine_set_again(MINE *self, char wants) {
+	self->wants |= wants;
+	self->err = EAGAIN;
+	self->errstr = strerror(EAGAIN);
+}
+
+// handle result of the failed SSL operation
+// returns 0 if operation should be retried later, -1 on error
+int _mine_ssl_result(MINE *self, int rv) {
+	switch (SSL_get_error(self->ssl, rv)) {
+		case SSL_ERROR_WANT_READ:
+			_mine_set_again(self, MINE_WANT_READ);
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			_mine_set_again(self, MINE_WANT_WRITE);
+			return 0;
+		case SSL_ERROR_ZERO_RETURN:
+			self->err = 0;
+			self->errstr = "Connection closed by server";
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (errno) {
+				_mine_set_sys_error(self);
+				return -1;
+			}
+			self->err = 0;
+			self->errstr = "Connection closed by server";
+			return -1;
+		default:
+			_mine_set_ssl_error(self);
+			return -1;
+	}
+}
+
+// returns number of bytes written, 0 if operation would block, -1 on error
 int _mine_write(MINE *self, const void *msg, size_t len) {
+	int rv;
+	
 	if (self->ssl) {
-		return SSL_write(self->ssl, msg, len);
+		// error queue is per thread, so failure of another handle
+		// would be taken for failure of this one by SSL_get_error()
+		ERR_clear_error();
+		rv = SSL_write(self->ssl, msg, len);
+		return rv > 0 ? rv : _mine_ssl_result(self, rv);
+	}
+	
+	do {
+		rv = send(self->sock, msg, len, MSG_NOSIGNAL);
+	} while (rv == -1 && errno == EINTR);
+	
+	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			_mine_set_again(self, MINE_WANT_WRITE);
+			return 0;
+		}
+		
+		_mine_set_sys_error(self);
 	}
 	
-	return send(self->sock, msg, len, MSG_NOSIGNAL);
+	return rv;
 }
 
+// returns number of bytes readed, 0 if operation would block, -1 on error or eof
 int _mine_read(MINE *self, void *buf, size_t len) {
+	int rv;
+	
 	if (self->ssl) {
-		return SSL_read(self->ssl, buf, len);
+		ERR_clear_error();
+		rv = SSL_read(self->ssl, buf, len);
+		return rv > 0 ? rv : _mine_ssl_result(self, rv);
 	}
 	
-	return recv(self->sock, buf, len, 0);
-}
-
-MINE *mine_new() {
-	MINE *self = malloc(sizeof(MINE));
+	do {
+		rv = recv(self->sock, buf, len, 0);
+	} while (rv == -1 && errno == EINTR);
 	
-	if (!self) {
-		return self;
+	if (rv == 0) {
+		self->err = 0;
+		self->errstr = "Connection closed by server";
+		return -1;
 	}
 	
-	self->sock        = 0;
-	self->ssl         = NULL;
-	self->ctx         = NULL;
-	self->err         = 0;
-	self->errstr      = NULL;
-	self->snd_event   = NULL;
-	self->rcv_event   = NULL;
-	self->snd_datalen = 0;
-	self->rcv_datalen = 0;
-	self->cur_datalen = 0;
-	self->readed      = 0;
-	
-	return self;
-}
-
-void mine_destroy(MINE *self) {
-	if (self->sock) {
-		mine_disconnect(self);
+	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			_mine_set_again(self, MINE_WANT_READ);
+			return 0;
+		}
+		
+		_mine_set_sys_error(self);
 	}
 	
-	free(self);
+	return rv;
 }
 
-char mine_connect(MINE *self, char *host, uint16_t port) {
-	if (self->sock) {
-		return 1;
+// append message to the output buffer
+char _mine_queue(MINE *self, const void *msg, size_t len) {
+	if (self->wlen + len > self->wcap) {
+		size_t cap = self->wcap ? self->wcap : MINE_CHUNK_SIZE;
+		while (cap < self->wlen + len) {
+			cap *= 2;
+		}
+		
+		char *wbuf = realloc(self->wbuf, cap);
+		if (!wbuf) {
+			_mine_set_sys_error(self);
+			return 0;
+		}
+		
+		self->wbuf = wbuf;
+		self->wcap = cap;
 	}
 	
-	int sock = 0;
-	SSL *ssl = NULL;
-	SSL_CTX *ctx = NULL;
-	BIO *bio = NULL;
+	memcpy(self->wbuf + self->wlen, msg, len);
+	self->wlen += len;
 	
-	sock = socket(PF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-		goto MINE_CONNECT_ERROR_SYS;
+	return 1;
+}
+
+// write what it could and keep the rest in the output buffer
+// in blocking mode whole message always written
+char _mine_send(MINE *self, const void *msg, size_t len) {
+	if (self->wlen == self->woff) {
+		while (len > 0) {
+			int rv = _mine_write(self, msg, len);
+			if (rv < 0) {
+				return 0;
+			}
+			if (rv == 0) {
+				break;
+			}
+			
+			msg = (const char *)msg + rv;
+			len -= rv;
+		}
+		
+		if (len == 0) {
+			return 1;
+		}
+		
+		self->woff = self->wlen = 0;
 	}
 	
-	struct hostent *hostinfo = gethostbyname(host);
-	if (!hostinfo) {
-		goto MINE_CONNECT_ERROR_SYS;
+	return _mine_queue(self, msg, len);
+}
+
+// same as _mine_send, but for the message consisting of several parts
+// plain socket gets all parts with one sendmsg, ssl gets one record
+// with up to MINE_SSL_RECORD_SIZE bytes of the message
+char _mine_sendv(MINE *self, struct iovec *iov, int iovcnt) {
+	if (self->wlen == self->woff) {
+		if (self->ssl) {
+			size_t room = MINE_SSL_RECORD_SIZE;
+			while (iovcnt > 0 && room > 0) {
+				size_t len = iov->iov_len < room ? iov->iov_len : room;
+				if (!_mine_queue(self, iov->iov_base, len)) {
+					return 0;
+				}
+				
+				room -= len;
+				iov->iov_base = (char *)iov->iov_base + len;
+				if ((iov->iov_len -= len) == 0) {
+					iov++;
+					iovcnt--;
+				}
+			}
+			
+			if (!mine_flush(self) && self->err != EAGAIN) {
+				return 0;
+			}
+		}
+		else {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			
+			while (iovcnt > 0) {
+				msg.msg_iov = iov;
+				msg.msg_iovlen = iovcnt;
+				
+				ssize_t rv = sendmsg(self->sock, &msg, MSG_NOSIGNAL);
+				if (rv == -1) {
+					if (errno == EINTR) {
+						continue;
+					}
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						_mine_set_again(self, MINE_WANT_WRITE);
+						break;
+					}
+					
+					_mine_set_sys_error(self);
+					return 0;
+				}
+				
+				// skip written parts
+				while (iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+					rv -= iov->iov_len;
+					iov++;
+					iovcnt--;
+				}
+				if (iovcnt > 0) {
+					iov->iov_base = (char *)iov->iov_base + rv;
+					iov->iov_len -= rv;
+				}
+			}
+		}
 	}
 	
-	struct sockaddr_in dest;
-	dest.sin_family = AF_INET;
-	dest.sin_port = htons(port);
-	dest.sin_addr = *(struct in_addr *) hostinfo->h_addr;
-	
-	if(connect(sock, (struct sockaddr *)&dest, sizeof(dest)) != 0) {
-		goto MINE_CONNECT_ERROR_SYS;
+	for (; iovcnt > 0; iov++, iovcnt--) {
+		if (iov->iov_len > 0 && !_mine_send(self, iov->iov_base, iov->iov_len)) {
+			return 0;
+		}
 	}
 	
-	char protocol;
-	if (recv(sock, &protocol, 1, 0) != 1) {
-		goto MINE_CONNECT_ERROR_SYS;
-	}
+	return 1;
+}
+
+// send up to len bytes of the file directly from the kernel when possible
+// returns number of bytes sent, 0 if operation would block, -1 on error
+ssize_t _mine_send_file(MINE *self, int fd, off_t off, size_t len, char fifo) {
+	ssize_t rv;
 	
-	if (protocol == MINE_PROTO_SSL) {
-		if (!MINE_SSL_LOADED) {
-			SSL_library_init();
-			SSL_load_error_strings();
-			MINE_SSL_LOADED = 1;
+	if (self->ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+		if (!fifo && BIO_get_ktls_send(SSL_get_wbio(self->ssl))) {
+			rv = SSL_sendfile(self->ssl, fd, off, len, 0);
+			return rv > 0 ? rv : _mine_ssl_result(self, rv);
 		}
+#endif
+	}
+	else {
+		do {
+			rv = fifo ? splice(fd, NULL, self->sock, NULL, len, SPLICE_F_MORE) : sendfile(self->sock, fd, &off, len);
+		} while (rv == -1 && errno == EINTR);
 		
-		ctx = SSL_CTX_new( SSLv23_method() );
-		if (!ctx) { 
-			goto MINE_CONNECT_ERROR_SSL;
-		};
-		
-		ssl = SSL_new(ctx);
-		if (!ssl) {
-			goto MINE_CONNECT_ERROR_SSL;
+		if (rv > 0) {
+			return rv;
 		}
-		
-		bio = BIO_new_socket(sock, BIO_NOCLOSE);
-		if (!bio) {
-			goto MINE_CONNECT_ERROR_SSL;
+		if (rv == 0) {
+			goto MINE_SEND_FILE_EOF;
 		}
-		
-		SSL_set_bio(ssl, bio, bio);
-		if (SSL_connect(ssl) <= 0) {
-			goto MINE_CONNECT_ERROR_SSL;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			_mine_set_again(self, MINE_WANT_WRITE);
+			return 0;
 		}
-		
-		self->ssl = ssl;
-		self->ctx = ctx;
+		if (errno != EINVAL && errno != ENOSYS) {
+			_mine_set_sys_error(self);
+			return -1;
+		}
+		// this kind of file could not be sent by the kernel
 	}
 	
-	self->sock = sock;
-	return 1;
+	// copy through the user space, what was not written stays in the output buffer
+	char buf[MINE_SSL_RECORD_SIZE];
+	if (len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
 	
+	do {
+		rv = fifo ? read(fd, buf, len) : pread(fd, buf, len, off);
+	} while (rv == -1 && errno == EINTR);
 	
-	MINE_CONNECT_ERROR_SYS:
+	if (rv == -1) {
 		_mine_set_sys_error(self);
-		goto MINE_CONNECT_ERROR;
+		return -1;
+	}
+	if (rv == 0) {
+		goto MINE_SEND_FILE_EOF;
+	}
 	
-	MINE_CONNECT_ERROR_SSL:
-		_mine_set_ssl_error(self);
-		goto MINE_CONNECT_ERROR;
+	return _mine_send(self, buf, rv) ? rv : -1;
 	
-	MINE_CONNECT_ERROR:
-		if (ctx) SSL_CTX_free(self->ctx);
-		if (sock) close(sock);
-		return 0;
+	MINE_SEND_FILE_EOF:
+		self->err = 0;
+		self->errstr = "Unexpected end of file";
+		return -1;
 }
 
-char mine_disconnect(MINE *self) {
-	if (self->ssl) {
-		SSL_CTX_free(self->ctx);
-		self->ssl = NULL;
-		self->ctx = NULL;
-	}
-	
-	if (close(self->sock) == -1) {
-		_mine_set_sys_error(self);
-		return 0;
+// read exactly len bytes to the buffer, already readed bytes stored in *have
+// returns 1 when done, 0 if operation would block, -1 on error
+int _mine_read_full(MINE *self, char *buf, size_t len, size_t *have) {
+	while (*have < len) {
+		int rv = _mine_read(self, buf + *have, len - *have);
+		if (rv <= 0) {
+			return rv;
+		}
+		
+		*have += rv;
 	}
 	
 	return 1;
 }
 
-char mine_login(MINE *self, char *login, char *password) {
-	unsigned char login_len = login ? strlen(login) : 0;
-	unsigned char password_len = password ? strlen(password) : 0;
-	
-	int msg_len = login_len+password_len+2;
-	char buf[msg_len];
-	sprintf(buf, "%c%s%c%s", login_len, login ? login : "", password_len, password ? password : "");
-	if (_mine_write(self, buf, msg_len) <= 0) {
-		_mine_set_error(self);
-		return 0;
+// read as much as possible to the input buffer
+// returns number of bytes readed, 0 if operation would block, -1 on error
+int _mine_fill(MINE *self) {
+	if (!self->rbuf) {
+		self->rbuf = malloc(MINE_RBUF_SIZE);
+		if (!self->rbuf) {
+			_mine_set_sys_error(self);
+			return -1;
+		}
 	}
 	
-	char login_status;
-	if (_mine_read(self, &login_status, 1) <= 0) {
-		_mine_set_error(self);
-		return 0;
+	if (self->rpos > 0) {
+		// only incomplete header could remain here
+		memmove(self->rbuf, self->rbuf + self->rpos, self->rlen - self->rpos);
+		self->rlen -= self->rpos;
+		self->rpos = 0;
 	}
 	
-	if (login_status == MINE_PROTO_AUTH_FAIL) {
-		self->err = 0;
-		self->errstr = "Login failed";
-		return 0;
+	int rv = _mine_read(self, self->rbuf + self->rlen, MINE_RBUF_SIZE - self->rlen);
+	if (rv > 0) {
+		self->rlen += rv;
 	}
 	
-	return 1;
+	return rv;
 }
 
-char mine_event_reg(MINE *self, char *event, char *ip) {
-	unsigned char event_len = strlen(event);
+// write hello event to buf of MINE_HELLO_LEN bytes
+void _mine_hello(char *buf) {
+	uint32_t caps = htonl(MINE_CAPS);
 	
-	struct in_addr addr;
-	if (!inet_aton(ip, &addr)) {
-		_mine_set_sys_error(self);
-		return 0;
-	}
+	buf[0] = MINE_PROTO_EVENT_SND;
+	buf[1] = MINE_HELLO_LEN - 2;
+	memcpy(buf+2, MINE_PROTO_HELLO_MAGIC, 5);
+	buf[7] = MINE_PROTO_VERSION;
+	memcpy(buf+8, &caps, 4);
+}
+
+// handle server hello if it is in the input buffer
+// returns 1 if hello was handled
+char _mine_recv_hello(MINE *self) {
+	unsigned char *hdr = (unsigned char *)self->rbuf + self->rpos;
+	uint32_t caps;
 	
-	int msg_len = event_len+6;
-	char buf[msg_len];
-	sprintf(buf, "%c%c%s", MINE_PROTO_EVENT_REG, event_len, event);
-	memcpy(buf+event_len+2, &(addr.s_addr), 4);
-	if (_mine_write(self, buf, msg_len) <= 0) {
-		_mine_set_error(self);
+	if (self->rlen - self->rpos < 6 || hdr[0] != MINE_PROTO_HELLO) {
 		return 0;
 	}
 	
+	memcpy(&caps, hdr+2, 4);
+	self->version = hdr[1] < MINE_PROTO_VERSION ? hdr[1] : MINE_PROTO_VERSION;
+	self->caps = ntohl(caps) & MINE_CAPS;
+	self->rpos += 6;
+	
 	return 1;
 }
 
-char mine_event_send(MINE *self, char *event, int64_t datalen, int chunklen, char *data) {
-	if (self->snd_event == NULL || strcmp(event, self->snd_event) != 0) {
-		if (self->snd_datalen != 0) {
-			self->err = 0;
-			self->errstr = "Incomplete data remain from previous event";
-			return 0;
-		}
-		
-		if (self->snd_event != NULL) {
-			free(self->snd_event);
-		}
-		self->snd_event = strdup(event);
-		int event_len = strlen(event);
-		int msg_len = event_len + 2;
-		char buf[msg_len];
-		sprintf(buf, "%c%c%s", MINE_PROTO_EVENT_SND, event_len, event);
-		if (_mine_write(self, buf, msg_len) <= 0) {
-			_mine_set_error(self);
-			return 0;
-		}
-	}
+// free tables of event ids
+void _mine_free_ids(MINE *self) {
+	size_t i;
 	
-	if (self->snd_datalen == 0) {
-		self->snd_datalen = datalen;
-		char buf[9];
-		sprintf(buf, "%c", MINE_PROTO_DATA_SND);
-		memcpy(buf+1, &datalen, 8);
-		if (_mine_write(self, buf, 9) <= 0) {
-			_mine_set_error(self);
-			return 0;
+	if (self->snd_ids) {
+		for (i=0; i<MINE_SND_IDS; i++) {
+			free(self->snd_ids[i]);
 		}
+		free(self->snd_ids);
+		self->snd_ids = NULL;
+		self->snd_nids = 0;
 	}
 	
-	if (_mine_write(self, data, chunklen) <= 0) {
-		_mine_set_error(self);
-		return 0;
+	if (self->rcv_ids) {
+		for (i=0; i<self->rcv_nids; i++) {
+			free(self->rcv_ids[i]);
+		}
+		free(self->rcv_ids);
+		self->rcv_ids = NULL;
+		self->rcv_nids = 0;
 	}
-	
-	self->snd_datalen -= chunklen;
-	return 1;
 }
 
-int mine_event_recv(MINE *self, char **event, int64_t *datalen, char *buf) {
-	if (self->rcv_datalen == 0 && self->readed) {
-		self->readed = 0;
-		self->cur_datalen = 0;
-		return -2;
-	}
-	
-	int readed = 0;
-	bzero(buf, MINE_CHUNK_SIZE);
+// find id of the event interned for sending, intern it if there is a room
+// *def set to 1 if event was interned just now, so its definition should be sent
+// returns -1 if event has no id
+int _mine_snd_id(MINE *self, const char *event, char *def) {
+	uint32_t hash = 2166136261u;
+	const char *c;
+	size_t i;
 	
-	if (self->rcv_datalen == 0) {
-		char proto_op;
-		if (_mine_read(self, &proto_op, 1) <= 0) {
-			_mine_set_error(self);
+	*def = 0;
+	if (!self->snd_ids) {
+		self->snd_ids = calloc(MINE_SND_IDS, sizeof(char*));
+		if (!self->snd_ids) {
 			return -1;
 		}
+	}
+	
+	for (c=event; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 16777619;
+	}
+	
+	// open addressing, nothing is ever removed, so slot could be used as id
+	for (i=0; i<MINE_SND_IDS; i++) {
+		size_t slot = (hash + i) & (MINE_SND_IDS-1);
 		
-		if (proto_op == MINE_PROTO_EVENT_RCV) {
-			char ev_len;
-			if (_mine_read(self, &ev_len, 1) <= 0) {
-				_mine_set_error(self);
-				return -1;
-			}
-			
-			*event = malloc(ev_len+1);
-			if (!*event) {
-				_mine_set_sys_error(self);
-				return -1;
-			}
-			
-			bzero(*event, ev_len+1);
-			if (_mine_read(self, *event, ev_len) < ev_len) {
-				_mine_set_error(self);
+		if (!self->snd_ids[slot]) {
+			// leave some free slots to keep probes short
+			if (self->snd_nids >= MINE_SND_IDS/4*3 || !(self->snd_ids[slot] = strdup(event))) {
 				return -1;
 			}
 			
-			if (self->rcv_event) {
-				free(self->rcv_event);
-			}
-			self->rcv_event = *event;
-			
-			if (_mine_read(self, &proto_op, 1) <= 0) {
-				_mine_set_error(self);
-				return -1;
-			}
+			self->snd_nids++;
+			*def = 1;
+			return slot;
 		}
 		
-		if (proto_op == MINE_PROTO_DATA_RCV) {
-			if (_mine_read(self, &(self->rcv_datalen), 8) <= 0) {
-				_mine_set_error(self);
-				return -1;
-			}
-			
-			self->cur_datalen = self->rcv_datalen;
-		}
-		else {
-			self->err = 0;
-			self->errstr = "Unexpected protocol operation received";
-			return -1;
+		if (strcmp(self->snd_ids[slot], event) == 0) {
+			return slot;
 		}
 	}
 	
-	if (self->rcv_datalen) {
-		readed = _mine_read(self, buf, self->rcv_datalen > MINE_CHUNK_SIZE-1 ? MINE_CHUNK_SIZE-1 : self->rcv_datalen);
-		if (readed <= 0) {
-			_mine_set_error(self);
-			return -1;
+	return -1;
+}
+
+// find session slot for the server connected to sock
+// returns slot with the same server or least recently stored one, NULL on error
+SSL_SESSION **_mine_ctx_session(MINE_CTX *self, int sock) {
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	if (getpeername(sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+		return NULL;
+	}
+	
+	int i;
+	for (i=0; i<MINE_CTX_SESSIONS; i++) {
+		if (memcmp(&self->peers[i], &addr, sizeof(addr)) == 0) {
+			return &self->sessions[i];
 		}
-		
-		self->rcv_datalen -= readed;
 	}
 	
-	if (self->rcv_datalen == 0) {
-		self->readed = 1;
+	i = self->next++ % MINE_CTX_SESSIONS;
+	if (self->sessions[i]) {
+		SSL_SESSION_free(self->sessions[i]);
+		self->sessions[i] = NULL;
 	}
+	memcpy(&self->peers[i], &addr, sizeof(addr));
 	
-	if (!self->rcv_event) {
-		self->err = 0;
-		self->errstr = "Data received before event";
-		return -1;
+	return &self->sessions[i];
+}
+
+// called by openssl when server sent new session (ticket)
+int _mine_ctx_new_session(SSL *ssl, SSL_SESSION *session) {
+	MINE_CTX *self = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	if (!self) {
+		return 0;
 	}
 	
-	*datalen = self->cur_datalen;
-	*event = self->rcv_event;
-	return readed;
+	SSL_SESSION **slot = _mine_ctx_session(self, SSL_get_fd(ssl));
+	if (!slot) {
+		return 0;
+	}
+	
+	if (*slot) {
+		SSL_SESSION_free(*slot);
+	}
+	*slot = session;
+	
+	// we took the reference
+	return 1;
+}
+
+MINE_CTX *mine_ctx_new() {
+	if (!MINE_SSL_LOADED) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		MINE_SSL_LOADED = 1;
+	}
+	
+	MINE_CTX *self = calloc(1, sizeof(MINE_CTX));
+	if (!self) {
+		return self;
+	}
+	
+	self->ssl_ctx = SSL_CTX_new( SSLv23_method() );
+	if (!self->ssl_ctx) {
+		free(self);
+		return NULL;
+	}
+	
+	SSL_CTX_set_app_data(self->ssl_ctx, self);
+	// sessions stored by us per server, openssl could not lookup client sessions itself
+	SSL_CTX_set_session_cache_mode(self->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(self->ssl_ctx, _mine_ctx_new_session);
+#ifdef SSL_OP_ENABLE_KTLS
+	// let mine_event_send_fd() encrypt files in the kernel
+	SSL_CTX_set_options(self->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	return self;
+}
+
+void mine_ctx_free(MINE_CTX *self) {
+	if (self == MINE_DEFAULT_CTX) {
+		MINE_DEFAULT_CTX = NULL;
+	}
+	
+	// connections which still use ssl context should not refer to us
+	SSL_CTX_set_app_data(self->ssl_ctx, NULL);
+	SSL_CTX_free(self->ssl_ctx);
+	
+	int i;
+	for (i=0; i<MINE_CTX_SESSIONS; i++) {
+		if (self->sessions[i]) {
+			SSL_SESSION_free(self->sessions[i]);
+		}
+	}
+	
+	free(self);
+}
+
+// Sets context which will be used for ssl connections by mine_connect()
+// Connections which share the context resume ssl sessions of each other
+// Context should not be freed before the handle
+void mine_set_ctx(MINE *self, MINE_CTX *ctx) {
+	self->mctx = ctx;
+}
+
+MINE *mine_new() {
+	MINE *self = malloc(sizeof(MINE));
+	
+	if (!self) {
+		return self;
+	}
+	
+	self->sock        = -1;
+	self->ssl         = NULL;
+	self->ctx         = NULL;
+	self->mctx        = NULL;
+	self->err         = 0;
+	self->errstr      = NULL;
+	self->snd_event   = NULL;
+	self->rcv_event   = NULL;
+	self->snd_id      = -1;
+	self->snd_ids     = NULL;
+	self->snd_nids    = 0;
+	self->rcv_ids     = NULL;
+	self->rcv_nids    = 0;
+	self->snd_datalen = 0;
+	self->rcv_datalen = 0;
+	self->cur_datalen = 0;
+	self->rcv_seq     = 0;
+	self->next_seq    = 0;
+	self->readed      = 0;
+	self->version     = 1;
+	self->caps        = 0;
+	self->nonblock    = 0;
+	self->state       = MINE_STATE_NONE;
+	self->wants       = 0;
+	self->wbuf        = NULL;
+	self->wlen        = 0;
+	self->woff        = 0;
+	self->wcap        = 0;
+	self->rbuf        = NULL;
+	self->rpos        = 0;
+	self->rlen        = 0;
+	self->rcv_have    = 0;
+	self->pipe[0]     = -1;
+	self->pipe[1]     = -1;
+	
+	return self;
+}
+
+void mine_destroy(MINE *self) {
+	if (self->state != MINE_STATE_NONE) {
+		mine_disconnect(self);
+	}
+	
+	free(self->snd_event);
+	free(self->rcv_event);
+	_mine_free_ids(self);
+	free(self->wbuf);
+	free(self->rbuf);
+	if (self->pipe[0] != -1) {
+		close(self->pipe[0]);
+		close(self->pipe[1]);
+	}
+	free(self);
+}
+
+char mine_set_nonblock(MINE *self, char nonblock) {
+	self->nonblock = nonblock;
+	
+	if (self->sock != -1) {
+		int flags = fcntl(self->sock, F_GETFL);
+		if (flags == -1 || fcntl(self->sock, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1) {
+			_mine_set_sys_error(self);
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+int mine_fd(MINE *self) {
+	return self->sock;
+}
+
+int mine_wants(MINE *self) {
+	return self->wants | (self->wlen > self->woff ? MINE_WANT_WRITE : 0);
+}
+
+char mine_flush(MINE *self) {
+	self->wants &= ~MINE_WANT_WRITE;
+	
+	while (self->woff < self->wlen) {
+		int rv = _mine_write(self, self->wbuf + self->woff, self->wlen - self->woff);
+		if (rv <= 0) {
+			return 0;
+		}
+		
+		self->woff += rv;
+	}
+	
+	self->woff = self->wlen = 0;
+	return 1;
+}
+
+// In non-blocking mode returns 0 and sets err to EAGAIN while connection is
+// in progress. Call it again when mine_wants() condition is satisfied.
+// connect to the address and do greeting and ssl handshake
+// addr used only when connection is not started yet
+char _mine_connect(MINE *self, struct sockaddr *addr, socklen_t addrlen) {
+	int rv;
+	
+	self->wants = 0;
+	switch (self->state) {
+		case MINE_STATE_NONE:
+			goto MINE_CONNECT_START;
+		case MINE_STATE_CONNECTING:
+			goto MINE_CONNECT_CONNECTING;
+		case MINE_STATE_GREETING:
+			goto MINE_CONNECT_GREETING;
+		case MINE_STATE_HANDSHAKE:
+			goto MINE_CONNECT_HANDSHAKE;
+		default:
+			return 1;
+	}
+	
+	MINE_CONNECT_START:
+	self->sock = socket(addr->sa_family, SOCK_STREAM, 0);
+	if (self->sock == -1) {
+		goto MINE_CONNECT_ERROR_SYS;
+	}
+	
+	if (self->nonblock && !mine_set_nonblock(self, 1)) {
+		goto MINE_CONNECT_ERROR;
+	}
+	
+	self->state = MINE_STATE_CONNECTING;
+	if (connect(self->sock, addr, addrlen) != 0) {
+		if (errno == EINPROGRESS) {
+			_mine_set_again(self, MINE_WANT_WRITE);
+			return 0;
+		}
+		
+		goto MINE_CONNECT_ERROR_SYS;
+	}
+	
+	MINE_CONNECT_CONNECTING:
+	if (self->nonblock) {
+		int sockerr;
+		socklen_t len = sizeof(sockerr);
+		
+		if (getsockopt(self->sock, SOL_SOCKET, SO_ERROR, &sockerr, &len) == -1) {
+			goto MINE_CONNECT_ERROR_SYS;
+		}
+		if (sockerr) {
+			errno = sockerr;
+			goto MINE_CONNECT_ERROR_SYS;
+		}
+	}
+	self->state = MINE_STATE_GREETING;
+	
+	MINE_CONNECT_GREETING: {
+		char protocol;
+		size_t have = 0;
+		
+		rv = _mine_read_full(self, &protocol, 1, &have);
+		if (rv == 0) {
+			return 0;
+		}
+		if (rv < 0) {
+			goto MINE_CONNECT_ERROR;
+		}
+		
+		if (protocol != MINE_PROTO_SSL) {
+			self->state = MINE_STATE_CONNECTED;
+			return 1;
+		}
+	}
+	
+	// connections share default context if user did not set own one
+	MINE_CTX *mctx = self->mctx;
+	if (!mctx) {
+		if (!MINE_DEFAULT_CTX && !(MINE_DEFAULT_CTX = mine_ctx_new())) {
+			goto MINE_CONNECT_ERROR_SSL;
+		}
+		mctx = MINE_DEFAULT_CTX;
+	}
+	
+	self->ctx = mctx->ssl_ctx;
+	SSL_CTX_up_ref(self->ctx);
+	
+	self->ssl = SSL_new(self->ctx);
+	if (!self->ssl) {
+		goto MINE_CONNECT_ERROR_SSL;
+	}
+	
+	BIO *bio = BIO_new_socket(self->sock, BIO_NOCLOSE);
+	if (!bio) {
+		goto MINE_CONNECT_ERROR_SSL;
+	}
+	
+	SSL_set_bio(self->ssl, bio, bio);
+	// output buffer could be moved between retries of the non-blocking write
+	SSL_set_mode(self->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	
+	// abbreviated handshake if we already talked to this server
+	SSL_SESSION **session = _mine_ctx_session(mctx, self->sock);
+	if (session && *session) {
+		SSL_set_session(self->ssl, *session);
+	}
+	self->state = MINE_STATE_HANDSHAKE;
+	
+	MINE_CONNECT_HANDSHAKE:
+	ERR_clear_error();
+	rv = SSL_connect(self->ssl);
+	if (rv <= 0) {
+		if (_mine_ssl_result(self, rv) == 0) {
+			return 0;
+		}
+		goto MINE_CONNECT_ERROR;
+	}
+	
+	self->state = MINE_STATE_CONNECTED;
+	return 1;
+	
+	
+	MINE_CONNECT_ERROR_SYS:
+		_mine_set_sys_error(self);
+		goto MINE_CONNECT_ERROR;
+	
+	MINE_CONNECT_ERROR_SSL:
+		_mine_set_ssl_error(self);
+		goto MINE_CONNECT_ERROR;
+	
+	MINE_CONNECT_ERROR:
+		if (self->ssl) SSL_free(self->ssl);
+		if (self->ctx) SSL_CTX_free(self->ctx);
+		if (self->sock != -1) close(self->sock);
+		self->ssl = NULL;
+		self->ctx = NULL;
+		self->sock = -1;
+		self->state = MINE_STATE_NONE;
+		return 0;
+}
+
+char mine_connect(MINE *self, char *host, uint16_t port) {
+	if (self->state != MINE_STATE_NONE) {
+		return _mine_connect(self, NULL, 0);
+	}
+	
+	struct hostent *hostinfo = gethostbyname(host);
+	if (!hostinfo) {
+		// gethostbyname() does not set errno
+		self->err = 0;
+		self->errstr = hstrerror(h_errno);
+		return 0;
+	}
+	
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+	dest.sin_addr = *(struct in_addr *) hostinfo->h_addr;
+	
+	return _mine_connect(self, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+// Connects to the server on the same host through unix domain socket
+char mine_connect_unix(MINE *self, char *path) {
+	if (self->state != MINE_STATE_NONE) {
+		return _mine_connect(self, NULL, 0);
+	}
+	
+	struct sockaddr_un dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(dest.sun_path)) {
+		self->err = ENAMETOOLONG;
+		self->errstr = strerror(ENAMETOOLONG);
+		return 0;
+	}
+	strcpy(dest.sun_path, path);
+	
+	return _mine_connect(self, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+char mine_disconnect(MINE *self) {
+	if (self->ssl) {
+		// openssl will not resume session of the connection which was not shut down
+		// quiet shutdown only marks it, so nothing written to possibly closed socket
+		if (self->state >= MINE_STATE_CONNECTED) {
+			SSL_set_quiet_shutdown(self->ssl, 1);
+			SSL_shutdown(self->ssl);
+		}
+		SSL_free(self->ssl);
+		SSL_CTX_free(self->ctx);
+		self->ssl = NULL;
+		self->ctx = NULL;
+	}
+	
+	self->state = MINE_STATE_NONE;
+	self->wants = 0;
+	self->woff = self->wlen = 0;
+	self->rpos = self->rlen = 0;
+	self->snd_datalen = self->rcv_datalen = 0;
+	self->rcv_seq = self->next_seq = 0;
+	self->rcv_have = 0;
+	self->version = 1;
+	self->caps = 0;
+	
+	// event ids are valid only for the connection
+	free(self->snd_event);
+	self->snd_event = NULL;
+	self->snd_id = -1;
+	_mine_free_ids(self);
+	
+	int sock = self->sock;
+	self->sock = -1;
+	if (close(sock) == -1) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	return 1;
+}
+
+// In non-blocking mode returns 0 and sets err to EAGAIN while waiting for
+// server response. Call it again when mine_wants() condition is satisfied.
+char mine_login(MINE *self, char *login, char *password) {
+	self->wants = 0;
+	
+	if (self->state != MINE_STATE_LOGIN) {
+		unsigned char login_len = login ? strlen(login) : 0;
+		unsigned char password_len = password ? strlen(password) : 0;
+		
+		// hello goes together with login, v1 server just ignores it
+		int msg_len = login_len+password_len+2+MINE_HELLO_LEN;
+		char buf[msg_len];
+		buf[0] = login_len;
+		memcpy(buf+1, login, login_len);
+		buf[login_len+1] = password_len;
+		memcpy(buf+login_len+2, password, password_len);
+		_mine_hello(buf+login_len+password_len+2);
+		if (!_mine_send(self, buf, msg_len)) {
+			return 0;
+		}
+		
+		self->state = MINE_STATE_LOGIN;
+	}
+	
+	if (!mine_flush(self)) {
+		return 0;
+	}
+	
+	while (self->rpos == self->rlen) {
+		if (_mine_fill(self) <= 0) {
+			return 0;
+		}
+	}
+	
+	self->state = MINE_STATE_CONNECTED;
+	if (self->rbuf[self->rpos++] == MINE_PROTO_AUTH_FAIL) {
+		self->err = 0;
+		self->errstr = "Login failed";
+		return 0;
+	}
+	
+	// v2 server answers hello right after login status, usually in the same
+	// packet, otherwise it will be handled when it comes
+	_mine_recv_hello(self);
+	return 1;
+}
+
+char mine_event_reg(MINE *self, char *event, char *ip) {
+	unsigned char event_len = strlen(event);
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	int msg_len = event_len+6;
+	char buf[msg_len];
+	buf[0] = MINE_PROTO_EVENT_REG;
+	buf[1] = event_len;
+	memcpy(buf+2, event, event_len);
+	memcpy(buf+event_len+2, &(addr.s_addr), 4);
+	if (!_mine_send(self, buf, msg_len)) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Registers n events from the same ip with one frame if server supports it,
+// otherwise with n registrations in one write
+char mine_event_reg_multi(MINE *self, char **events, size_t n, char *ip) {
+	char multi = (self->caps & MINE_CAP_SUBSCRIBE) != 0;
+	char buf[1+10+1+255+4];
+	size_t i;
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	if (multi) {
+		buf[0] = MINE_PROTO_EVENT_REG_MULTI;
+		if (!_mine_queue(self, buf, 1 + _mine_varint_put(buf+1, n))) {
+			return 0;
+		}
+	}
+	
+	for (i=0; i<n; i++) {
+		// multi frame consists of registrations without operation
+		unsigned char event_len = strlen(events[i]);
+		buf[0] = MINE_PROTO_EVENT_REG;
+		buf[1] = event_len;
+		memcpy(buf+2, events[i], event_len);
+		memcpy(buf+event_len+2, &(addr.s_addr), 4);
+		if (!_mine_queue(self, buf+multi, event_len+6-multi)) {
+			return 0;
+		}
+	}
+	
+	if (!mine_flush(self) && self->err != EAGAIN) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Server stops sending event from ip, needs server with MINE_CAP_SUBSCRIBE
+char mine_event_unreg(MINE *self, char *event, char *ip) {
+	if (!(self->caps & MINE_CAP_SUBSCRIBE)) {
+		self->err = 0;
+		self->errstr = "Server does not support unregistration";
+		return 0;
+	}
+	
+	unsigned char event_len = strlen(event);
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	int msg_len = event_len+6;
+	char buf[msg_len];
+	buf[0] = MINE_PROTO_EVENT_UNREG;
+	buf[1] = event_len;
+	memcpy(buf+2, event, event_len);
+	memcpy(buf+event_len+2, &(addr.s_addr), 4);
+	if (!_mine_send(self, buf, msg_len)) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Joins queue group of the event, each message of the event goes to one
+// member of the group only. Flags are MINE_GROUP_STICKY and MINE_GROUP_LEAVE
+char mine_event_reg_group(MINE *self, char *event, char *ip, char *group, int flags) {
+	if (!(self->caps & MINE_CAP_GROUP)) {
+		self->err = 0;
+		self->errstr = "Server does not support queue groups";
+		return 0;
+	}
+	
+	unsigned char event_len = strlen(event);
+	unsigned char group_len = strlen(group);
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	int msg_len = event_len+group_len+8;
+	char buf[msg_len];
+	buf[0] = MINE_PROTO_EVENT_REG_GROUP;
+	buf[1] = event_len;
+	memcpy(buf+2, event, event_len);
+	memcpy(buf+event_len+2, &(addr.s_addr), 4);
+	buf[event_len+6] = flags;
+	buf[event_len+7] = group_len;
+	memcpy(buf+event_len+8, group, group_len);
+	if (!_mine_send(self, buf, msg_len)) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Registers the event with flags, MINE_REG_CONFLATE asks server to keep only
+// the newest message of the event when this client does not read fast enough
+char mine_event_reg_flags(MINE *self, char *event, char *ip, int flags) {
+	if (!flags) {
+		return mine_event_reg(self, event, ip);
+	}
+	
+	if (!(self->caps & MINE_CAP_CONFLATE)) {
+		self->err = 0;
+		self->errstr = "Server does not support conflation";
+		return 0;
+	}
+	
+	unsigned char event_len = strlen(event);
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	int msg_len = event_len+7;
+	char buf[msg_len];
+	buf[0] = MINE_PROTO_EVENT_REG_FLAGS;
+	buf[1] = event_len;
+	memcpy(buf+2, event, event_len);
+	memcpy(buf+event_len+2, &(addr.s_addr), 4);
+	buf[event_len+6] = flags;
+	if (!_mine_send(self, buf, msg_len)) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Registers the event and asks server to send messages of the event from its
+// journal, starting from sequence number seq, before the new ones. Sequence
+// number of each received message is in rcv_seq, so after restart client could
+// continue from rcv_seq+1 of the last processed message. Zero means the oldest
+// message kept in the journal
+char mine_event_reg_from(MINE *self, char *event, char *ip, uint64_t seq) {
+	if (!(self->caps & MINE_CAP_JOURNAL)) {
+		self->err = 0;
+		self->errstr = "Server does not support journal";
+		return 0;
+	}
+	
+	unsigned char event_len = strlen(event);
+	
+	struct in_addr addr;
+	if (!inet_aton(ip, &addr)) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	
+	char buf[event_len+6+10];
+	buf[0] = MINE_PROTO_EVENT_REG_FROM;
+	buf[1] = event_len;
+	memcpy(buf+2, event, event_len);
+	memcpy(buf+event_len+2, &(addr.s_addr), 4);
+	if (!_mine_send(self, buf, event_len+6 + _mine_varint_put(buf+event_len+6, seq))) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// write frames which start the message of the event to buf of MINE_HEADER_SIZE bytes
+// changed is 1 if event differs from the previous one
+// returns length of the header
+int _mine_event_header(MINE *self, char *event, char changed, int64_t datalen, char *buf) {
+	unsigned char event_len = strlen(event);
+	int hlen = 0;
+	
+	if (changed) {
+		if (self->snd_event != NULL) {
+			free(self->snd_event);
+		}
+		self->snd_event = strdup(event);
+		self->snd_id = -1;
+		
+		if (self->caps & MINE_CAP_EVENT_ID) {
+			char def;
+			self->snd_id = _mine_snd_id(self, event, &def);
+			
+			if (def) {
+				// first use of the name, define its id
+				buf[0] = MINE_PROTO_EVENT_DEF;
+				hlen = 1 + _mine_varint_put(buf+1, self->snd_id);
+				buf[hlen++] = event_len;
+				memcpy(buf+hlen, event, event_len);
+				hlen += event_len;
+			}
+		}
+	}
+	
+	self->snd_datalen = datalen;
+	if (datalen >= 0 && self->snd_id != -1) {
+		// only id of the event and data length
+		int len = 1 + _mine_varint_put(buf+hlen+1, self->snd_id);
+		len += _mine_varint_put(buf+hlen+len, datalen);
+		
+		if (changed || len <= 9) {
+			buf[hlen] = MINE_PROTO_EVENT_ID_DATA_SND;
+			return hlen + len;
+		}
+	}
+	
+	if (datalen >= 0 && self->caps & MINE_CAP_COMPACT) {
+		// event and data length in one frame, for the same event
+		// only when it is not longer than separate data header
+		int len = 2 + event_len;
+		len += _mine_varint_put(buf+hlen+len, datalen);
+		
+		if (changed || len <= 9) {
+			buf[hlen] = MINE_PROTO_EVENT_DATA_SND;
+			buf[hlen+1] = event_len;
+			memcpy(buf+hlen+2, event, event_len);
+			return hlen + len;
+		}
+	}
+	
+	if (changed) {
+		buf[hlen] = MINE_PROTO_EVENT_SND;
+		buf[hlen+1] = event_len;
+		memcpy(buf+hlen+2, event, event_len);
+		hlen += event_len + 2;
+	}
+	
+	buf[hlen] = MINE_PROTO_DATA_SND;
+	memcpy(buf+hlen+1, &datalen, 8);
+	return hlen + 9;
+}
+
+// In non-blocking mode data which could not be written immediately stays in the
+// output buffer. Use mine_flush() when mine_wants() reports MINE_WANT_WRITE.
+char mine_event_send(MINE *self, char *event, int64_t datalen, int chunklen, char *data) {
+	// event, data header and data are gathered to the single write
+	struct iovec iov[2];
+	int iovcnt = 0;
+	char hdr[MINE_HEADER_SIZE];
+	char changed = self->snd_event == NULL || strcmp(event, self->snd_event) != 0;
+	
+	if (changed && self->snd_datalen != 0) {
+		self->err = 0;
+		self->errstr = "Incomplete data remain from previous event";
+		return 0;
+	}
+	
+	if (self->snd_datalen == 0) {
+		iov[iovcnt].iov_base = hdr;
+		iov[iovcnt++].iov_len = _mine_event_header(self, event, changed, datalen, hdr);
+	}
+	
+	iov[iovcnt].iov_base = data;
+	iov[iovcnt++].iov_len = chunklen;
+	if (!_mine_sendv(self, iov, iovcnt)) {
+		return 0;
+	}
+	
+	self->snd_datalen -= chunklen;
+	return 1;
+}
+
+// Sends n whole messages with one write. Messages are packed to the output buffer,
+// so in non-blocking mode what could not be written stays there as for mine_event_send()
+char mine_event_send_batch(MINE *self, const MINE_MSG *msgs, size_t n) {
+	char hdr[MINE_HEADER_SIZE];
+	size_t i;
+	
+	if (self->snd_datalen != 0) {
+		self->err = 0;
+		self->errstr = "Incomplete data remain from previous event";
+		return 0;
+	}
+	
+	for (i=0; i<n; i++) {
+		// the same pointer is the same event, no need to compare
+		char changed = self->snd_event == NULL ||
+			((i == 0 || msgs[i].event != msgs[i-1].event) && strcmp(msgs[i].event, self->snd_event) != 0);
+		
+		int hlen = _mine_event_header(self, msgs[i].event, changed, msgs[i].datalen, hdr);
+		self->snd_datalen = 0;
+		if (!_mine_queue(self, hdr, hlen) || !_mine_queue(self, msgs[i].data, msgs[i].datalen > 0 ? msgs[i].datalen : 0)) {
+			return 0;
+		}
+	}
+	
+	if (!mine_flush(self) && self->err != EAGAIN) {
+		return 0;
+	}
+	
+	return 1;
+}
+
+// Sends len bytes of the file starting from offset off as data of the event
+// Uses sendfile(2) or splice(2) for plain connections and kTLS for ssl if available
+// In non-blocking mode returns 0 with EAGAIN when socket is full, call it again
+// with the same arguments to continue
+char mine_event_send_fd(MINE *self, char *event, int fd, off_t off, int64_t len) {
+	if (self->snd_datalen == 0 || self->snd_event == NULL || strcmp(event, self->snd_event) != 0) {
+		if (!mine_event_send(self, event, len, 0, "")) {
+			return 0;
+		}
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		_mine_set_sys_error(self);
+		return 0;
+	}
+	char fifo = S_ISFIFO(st.st_mode);
+	
+	// skip what was sent by previous calls
+	off += len - self->snd_datalen;
+	while (self->snd_datalen > 0) {
+		if (self->wlen != self->woff && !mine_flush(self)) {
+			return 0;
+		}
+		
+		ssize_t rv = _mine_send_file(self, fd, off, self->snd_datalen > SSIZE_MAX ? SSIZE_MAX : self->snd_datalen, fifo);
+		if (rv <= 0) {
+			return 0;
+		}
+		
+		off += rv;
+		self->snd_datalen -= rv;
+	}
+	
+	return 1;
+}
+
+// write whole buffer to the file descriptor
+char _mine_write_fd(MINE *self, int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t rv = write(fd, buf, len);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			
+			_mine_set_sys_error(self);
+			return 0;
+		}
+		
+		buf += rv;
+		len -= rv;
+	}
+	
+	return 1;
+}
+
+// move len bytes from the socket to the file descriptor through the pipe
+// without copying to the user space
+// returns number of bytes moved, 0 if operation would block, -1 on error
+ssize_t _mine_splice_fd(MINE *self, int fd, size_t len) {
+	if (self->pipe[0] == -1 && pipe2(self->pipe, O_CLOEXEC) == -1) {
+		_mine_set_sys_error(self);
+		return -1;
+	}
+	
+	// not more than empty pipe could hold, so splice will not wait for the pipe
+	// socket in blocking mode should block, so no SPLICE_F_NONBLOCK
+	if (len > MINE_PIPE_SIZE) {
+		len = MINE_PIPE_SIZE;
+	}
+	
+	ssize_t rv;
+	do {
+		rv = splice(self->sock, NULL, self->pipe[1], NULL, len, SPLICE_F_MOVE);
+	} while (rv == -1 && errno == EINTR);
+	
+	if (rv == 0) {
+		self->err = 0;
+		self->errstr = "Connection closed by server";
+		return -1;
+	}
+	if (rv == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			_mine_set_again(self, MINE_WANT_READ);
+			return 0;
+		}
+		
+		_mine_set_sys_error(self);
+		return -1;
+	}
+	
+	// pipe should be empty before the next call
+	size_t left = rv;
+	while (left > 0) {
+		ssize_t n = splice(self->pipe[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+		if (n > 0) {
+			left -= n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EINVAL) {
+			// fd could not be spliced (opened with O_APPEND, tty, etc)
+			char buf[MINE_CHUNK_SIZE*16];
+			n = read(self->pipe[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+			if (n > 0 && _mine_write_fd(self, fd, buf, n)) {
+				left -= n;
+				continue;
+			}
+		}
+		
+		_mine_set_sys_error(self);
+		return -1;
+	}
+	
+	return rv;
+}
+
+// read event and data header of the next message
+// returns 1 on success, 0 on error or if operation would block
+char _mine_recv_header(MINE *self) {
+	// parse header from the input buffer
+	// and read more until it will be complete
+	while (1) {
+		unsigned char *hdr = (unsigned char *)self->rbuf + self->rpos;
+		size_t avail = self->rlen - self->rpos;
+		
+		if (avail > 0 && hdr[0] == MINE_PROTO_HELLO) {
+			if (_mine_recv_hello(self)) {
+				continue;
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_EVENT_RCV) {
+			if (avail > 1) {
+				unsigned char ev_len = hdr[1];
+				
+				if (avail > 2u + ev_len && hdr[2+ev_len] != MINE_PROTO_DATA_RCV) {
+					goto MINE_RECV_HEADER_UNEXPECTED;
+				}
+				
+				if (avail >= 2u + ev_len + 1 + 8) {
+					char *event = malloc(ev_len+1);
+					if (!event) {
+						_mine_set_sys_error(self);
+						return 0;
+					}
+					
+					memcpy(event, hdr+2, ev_len);
+					event[ev_len] = '\0';
+					
+					if (self->rcv_event) {
+						free(self->rcv_event);
+					}
+					self->rcv_event = event;
+					
+					memcpy(&(self->rcv_datalen), hdr+2+ev_len+1, 8);
+					self->rpos += 2 + ev_len + 1 + 8;
+					break;
+				}
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_EVENT_DATA_RCV) {
+			if (avail > 1 && avail > 2u + hdr[1]) {
+				unsigned char ev_len = hdr[1];
+				uint64_t datalen;
+				int vlen = _mine_varint_get(hdr+2+ev_len, avail-2-ev_len, &datalen);
+				
+				if (vlen == -1) {
+					goto MINE_RECV_HEADER_UNEXPECTED;
+				}
+				
+				if (vlen > 0) {
+					char *event = malloc(ev_len+1);
+					if (!event) {
+						_mine_set_sys_error(self);
+						return 0;
+					}
+					
+					memcpy(event, hdr+2, ev_len);
+					event[ev_len] = '\0';
+					
+					if (self->rcv_event) {
+						free(self->rcv_event);
+					}
+					self->rcv_event = event;
+					
+					self->rcv_datalen = datalen;
+					self->rpos += 2 + ev_len + vlen;
+					break;
+				}
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_EVENT_DEF) {
+			uint64_t id;
+			int vlen = _mine_varint_get(hdr+1, avail-1, &id);
+			
+			if (vlen == -1 || id >= MINE_PROTO_EVENT_IDS) {
+				goto MINE_RECV_HEADER_UNEXPECTED;
+			}
+			
+			if (vlen > 0 && avail > 1u + vlen && avail >= 2u + vlen + hdr[1+vlen]) {
+				unsigned char ev_len = hdr[1+vlen];
+				
+				if (id >= self->rcv_nids) {
+					size_t nids = id < 64 ? 64 : id * 2;
+					if (nids > MINE_PROTO_EVENT_IDS) {
+						nids = MINE_PROTO_EVENT_IDS;
+					}
+					
+					char **ids = realloc(self->rcv_ids, nids * sizeof(char*));
+					if (!ids) {
+						_mine_set_sys_error(self);
+						return 0;
+					}
+					memset(ids + self->rcv_nids, 0, (nids - self->rcv_nids) * sizeof(char*));
+					self->rcv_ids = ids;
+					self->rcv_nids = nids;
+				}
+				
+				free(self->rcv_ids[id]);
+				self->rcv_ids[id] = malloc(ev_len+1);
+				if (!self->rcv_ids[id]) {
+					_mine_set_sys_error(self);
+					return 0;
+				}
+				
+				memcpy(self->rcv_ids[id], hdr+2+vlen, ev_len);
+				self->rcv_ids[id][ev_len] = '\0';
+				self->rpos += 2 + vlen + ev_len;
+				continue;
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_EVENT_ID_DATA_RCV) {
+			uint64_t id, datalen;
+			int vlen = _mine_varint_get(hdr+1, avail-1, &id);
+			int dlen = vlen > 0 ? _mine_varint_get(hdr+1+vlen, avail-1-vlen, &datalen) : 0;
+			
+			if (vlen == -1 || dlen == -1) {
+				goto MINE_RECV_HEADER_UNEXPECTED;
+			}
+			
+			if (dlen > 0) {
+				if (id >= self->rcv_nids || !self->rcv_ids[id]) {
+					goto MINE_RECV_HEADER_UNEXPECTED;
+				}
+				
+				char *event = strdup(self->rcv_ids[id]);
+				if (!event) {
+					_mine_set_sys_error(self);
+					return 0;
+				}
+				
+				if (self->rcv_event) {
+					free(self->rcv_event);
+				}
+				self->rcv_event = event;
+				
+				self->rcv_datalen = datalen;
+				self->rpos += 1 + vlen + dlen;
+				break;
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_EVENT_SEQ) {
+			// sequence number of the message, which header follows
+			int vlen = _mine_varint_get(hdr+1, avail-1, &self->next_seq);
+			
+			if (vlen == -1) {
+				goto MINE_RECV_HEADER_UNEXPECTED;
+			}
+			
+			if (vlen > 0) {
+				self->rpos += 1 + vlen;
+				continue;
+			}
+		}
+		else if (avail > 0 && hdr[0] == MINE_PROTO_DATA_RCV) {
+			if (avail >= 9) {
+				memcpy(&(self->rcv_datalen), hdr+1, 8);
+				self->rpos += 9;
+				break;
+			}
+		}
+		else if (avail > 0) {
+			goto MINE_RECV_HEADER_UNEXPECTED;
+		}
+		
+		if (_mine_fill(self) <= 0) {
+			return 0;
+		}
+	}
+	
+	self->cur_datalen = self->rcv_datalen;
+	self->rcv_seq = self->next_seq;
+	self->next_seq = 0;
+	if (!self->rcv_event) {
+		self->err = 0;
+		self->errstr = "Data received before event";
+		return 0;
+	}
+	
+	return 1;
+	
+	MINE_RECV_HEADER_UNEXPECTED:
+		self->rpos = self->rlen = 0;
+		self->err = 0;
+		self->errstr = "Unexpected protocol operation received";
+		return 0;
+}
+
+// Returns number of bytes stored in buf, -2 after last chunk of the data and -1
+// on error. In non-blocking mode returns -1 and sets err to EAGAIN if data is not
+// available yet. Call it again when mine_wants() condition is satisfied. Data is
+// read in large chunks to the internal buffer, so call it until EAGAIN before poll.
+int mine_event_recv(MINE *self, char **event, int64_t *datalen, char *buf) {
+	if (self->rcv_datalen == 0 && self->readed) {
+		self->readed = 0;
+		self->cur_datalen = 0;
+		return -2;
+	}
+	
+	int readed = 0;
+	bzero(buf, MINE_CHUNK_SIZE);
+	self->wants &= ~MINE_WANT_READ;
+	
+	if (self->rcv_datalen == 0 && !_mine_recv_header(self)) {
+		return -1;
+	}
+	
+	if (self->rcv_datalen) {
+		if (self->rpos == self->rlen && _mine_fill(self) <= 0) {
+			return -1;
+		}
+		
+		readed = self->rlen - self->rpos;
+		if (readed > MINE_CHUNK_SIZE-1) {
+			readed = MINE_CHUNK_SIZE-1;
+		}
+		if (readed > self->rcv_datalen) {
+			readed = self->rcv_datalen;
+		}
+		
+		memcpy(buf, self->rbuf + self->rpos, readed);
+		self->rpos += readed;
+		self->rcv_datalen -= readed;
+	}
+	
+	if (self->rcv_datalen == 0) {
+		self->readed = 1;
+	}
+	
+	*datalen = self->cur_datalen;
+	*event = self->rcv_event;
+	return readed;
+}
+
+// Stores up to size bytes of the data to the caller's buffer. Returns number of
+// bytes stored or -1 on error, the message is complete when all *datalen bytes
+// were returned. With MINE_RECV_WHOLE flag message which fits in the buffer is
+// returned by one call. In non-blocking mode returns -1 with EAGAIN as
+// mine_event_recv() does, call it again with the same buffer to continue.
+int64_t mine_event_recv_buf(MINE *self, char **event, int64_t *datalen, char *buf, size_t size, int flags) {
+	self->wants &= ~MINE_WANT_READ;
+	self->readed = 0;
+	
+	if (self->rcv_have == 0 && self->rcv_datalen == 0 && !_mine_recv_header(self)) {
+		return -1;
+	}
+	
+	size_t have = self->rcv_have;
+	char whole = (flags & MINE_RECV_WHOLE) && have + self->rcv_datalen <= size;
+	
+	while (self->rcv_datalen > 0 && have < size) {
+		size_t need = size - have;
+		if (need > (uint64_t)self->rcv_datalen) {
+			need = self->rcv_datalen;
+		}
+		
+		int rv;
+		if (self->rpos < self->rlen) {
+			rv = self->rlen - self->rpos;
+			if ((size_t)rv > need) {
+				rv = need;
+			}
+			
+			memcpy(buf + have, self->rbuf + self->rpos, rv);
+			self->rpos += rv;
+		}
+		else if (need >= MINE_RBUF_SIZE) {
+			// large buffer, read directly to it
+			// SSL_read() and rv take int
+			rv = _mine_read(self, buf + have, need > INT_MAX ? INT_MAX : need);
+		}
+		else {
+			rv = _mine_fill(self);
+			if (rv > 0) {
+				continue;
+			}
+		}
+		
+		if (rv <= 0) {
+			// keep what was already stored to the buffer
+			self->rcv_have = have;
+			return -1;
+		}
+		
+		have += rv;
+		self->rcv_datalen -= rv;
+		if (!whole) {
+			break;
+		}
+	}
+	
+	self->rcv_have = 0;
+	*event = self->rcv_event;
+	*datalen = self->cur_datalen;
+	return have;
+}
+
+// Receives whole data of the message into the file descriptor. Returns length
+// of the data or -1 on error. Plain connections move data with splice(2) without
+// copying to the user space, ssl connections read it by MINE_RBUF_SIZE chunks.
+// In non-blocking mode returns -1 with EAGAIN as mine_event_recv() does, call
+// it again to continue.
+int64_t mine_event_recv_to_fd(MINE *self, char **event, int64_t *datalen, int fd) {
+	self->wants &= ~MINE_WANT_READ;
+	self->readed = 0;
+	
+	if (self->rcv_datalen == 0 && !_mine_recv_header(self)) {
+		return -1;
+	}
+	
+	*event = self->rcv_event;
+	*datalen = self->cur_datalen;
+	
+	while (self->rcv_datalen > 0) {
+		size_t avail = self->rlen - self->rpos;
+		
+		if (avail > 0) {
+			if (avail > (uint64_t)self->rcv_datalen) {
+				avail = self->rcv_datalen;
+			}
+			
+			if (!_mine_write_fd(self, fd, self->rbuf + self->rpos, avail)) {
+				return -1;
+			}
+			
+			self->rpos += avail;
+			self->rcv_datalen -= avail;
+		}
+		else if (self->ssl) {
+			if (_mine_fill(self) <= 0) {
+				return -1;
+			}
+		}
+		else {
+			ssize_t rv = _mine_splice_fd(self, fd, self->rcv_datalen > SSIZE_MAX ? SSIZE_MAX : self->rcv_datalen);
+			if (rv <= 0) {
+				return -1;
+			}
+			
+			self->rcv_datalen -= rv;
+		}
+	}
+	
+	self->cur_datalen = 0;
+	return *datalen;
+}
+
+// Attaches to the shared memory ring of the broker on the same host
+// Only frames published after attach will be received
+// Returns NULL on error, errno is set
+MINE_SHM *mine_shm_attach(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		goto MINE_SHM_ATTACH_ERROR;
+	}
+	if ((size_t)st.st_size <= MINE_SHM_HDR_SIZE) {
+		errno = EINVAL;
+		goto MINE_SHM_ATTACH_ERROR;
+	}
+	
+	// futex wait needs only read access, so readers could not break the ring
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		goto MINE_SHM_ATTACH_ERROR;
+	}
+	close(fd);
+	
+	MINE_SHM_HDR *hdr = map;
+	if (hdr->magic != MINE_SHM_MAGIC || hdr->size + MINE_SHM_HDR_SIZE > (uint64_t)st.st_size) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	
+	MINE_SHM *self = calloc(1, sizeof(MINE_SHM));
+	if (!self) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	
+	self->hdr = hdr;
+	self->ring = (char *)map + MINE_SHM_HDR_SIZE;
+	self->maplen = st.st_size;
+	self->pos = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	
+	return self;
+	
+	MINE_SHM_ATTACH_ERROR:
+		close(fd);
+		return NULL;
+}
+
+void mine_shm_detach(MINE_SHM *self) {
+	munmap(self->hdr, self->maplen);
+	free(self);
+}
+
+// Returns length of the next event data and sets pointers to the event name and
+// data inside the ring, no copying. They are valid until the broker will overwrite
+// them, so consumer should keep up and must call mine_shm_valid() after it used
+// them, otherwise it could not know that the data was torn. Waits up to timeout milliseconds, -1 waits
+// forever, 0 returns immediately. Returns -1 with EAGAIN if there is no event yet
+// and -1 with ESPIPE when consumer was too slow and some frames were lost (counted
+// in lost, continue from the oldest available frame by the next call).
+// Sender ip of the event (network order) stored in host.
+int64_t mine_shm_recv(MINE_SHM *self, char **event, char **data, int timeout) {
+	MINE_SHM_HDR *hdr = self->hdr;
+	struct timespec deadline;
+	
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	
+	while (1) {
+		// remember futex value before check, so wakeup after check will not be lost
+		uint32_t seen = __atomic_load_n(&hdr->futex, __ATOMIC_SEQ_CST);
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		
+		if (head - self->pos > hdr->size) {
+			goto MINE_SHM_RECV_OVERRUN;
+		}
+		
+		if (head != self->pos) {
+			MINE_SHM_FRAME *frame = (MINE_SHM_FRAME *)(self->ring + self->pos % hdr->size);
+			uint32_t state = __atomic_load_n(&frame->state, __ATOMIC_ACQUIRE);
+			uint32_t len = frame->len;
+			uint32_t elen = frame->elen;
+			int64_t datalen = frame->datalen;
+			
+			// frame could be overwritten while we read it
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) > self->pos) {
+				goto MINE_SHM_RECV_OVERRUN;
+			}
+			
+			if (len < 8 || len % 8 || len > hdr->size - self->pos % hdr->size) {
+				self->err = 0;
+				self->errstr = "Broken frame in the ring";
+				return -1;
+			}
+			
+			if (state == MINE_SHM_SKIP || state == MINE_SHM_DROPPED) {
+				self->pos += len;
+				continue;
+			}
+			
+			if (state == MINE_SHM_READY) {
+				*event = (char *)(frame + 1);
+				*data = *event + elen + 1;
+				self->host = frame->host;
+				self->frame = self->pos;
+				self->pos += len;
+				return datalen;
+			}
+			
+			// frame is not complete yet, wait for it
+		}
+		
+		if (timeout == 0) {
+			self->err = EAGAIN;
+			self->errstr = strerror(EAGAIN);
+			return -1;
+		}
+		
+		struct timespec rel, *prel = NULL;
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &rel);
+			rel.tv_sec = deadline.tv_sec - rel.tv_sec;
+			rel.tv_nsec = deadline.tv_nsec - rel.tv_nsec;
+			if (rel.tv_nsec < 0) {
+				rel.tv_sec--;
+				rel.tv_nsec += 1000000000L;
+			}
+			if (rel.tv_sec < 0) {
+				self->err = EAGAIN;
+				self->errstr = strerror(EAGAIN);
+				return -1;
+			}
+			prel = &rel;
+		}
+		
+		syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, seen, prel, NULL, 0);
+	}
+	
+	MINE_SHM_RECV_OVERRUN:
+		self->pos = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		self->lost++;
+		self->err = ESPIPE;
+		self->errstr = "Consumer is too slow, frames lost";
+		return -1;
+}
+
+// Checks that event and data of the last mine_shm_recv() were not overwritten
+// by the broker while consumer used them. Returns 0 and sets ESPIPE if they were,
+// consumer should drop what it got from them then. Next mine_shm_recv() will
+// continue from the oldest available frame
+char mine_shm_valid(MINE_SHM *self) {
+	// reads of the frame should be done before tail is checked
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&self->hdr->tail, __ATOMIC_ACQUIRE) > self->frame) {
+		self->lost++;
+		self->err = ESPIPE;
+		self->errstr = "Frame was overwritten while consumer used it";
+		return 0;
+	}
+	
+	return 1;
 }
@@ -1,6 +1,10 @@
 #ifndef MINE_H
 #define MINE_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice(2)
+#endif
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -8,8 +12,19 @@
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -23,34 +38,214 @@
 #define MINE_PROTO_EVENT_SND    2
 #define MINE_PROTO_EVENT_REG    3
 #define MINE_PROTO_WAITING      4
-#define MINE_PROTO_AUTH_SUCCESS 0
+#define MINE_PROTO_AUTH_SUCCESS 1
 #define MINE_PROTO_AUTH_FAIL    0
+#define MINE_PROTO_HELLO        5
+#define MINE_PROTO_HELLO_MAGIC  "\0MINE"
+#define MINE_PROTO_VERSION      2
+#define MINE_HELLO_LEN          12
+#define MINE_PROTO_EVENT_DATA_RCV 6
+#define MINE_PROTO_EVENT_DATA_SND 6
+#define MINE_PROTO_EVENT_DEF      7
+#define MINE_PROTO_EVENT_ID_DATA_RCV 8
+#define MINE_PROTO_EVENT_ID_DATA_SND 8
+#define MINE_PROTO_EVENT_IDS      65536 // event ids are less than this
+#define MINE_PROTO_EVENT_REG_MULTI 9
+#define MINE_PROTO_EVENT_UNREG    10
+#define MINE_PROTO_EVENT_REG_GROUP 11
+#define MINE_PROTO_EVENT_REG_FLAGS 12
+#define MINE_PROTO_EVENT_REG_FROM 13
+#define MINE_PROTO_EVENT_SEQ      14
+
+// flags of queue group registration
+#define MINE_GROUP_STICKY       1 // messages of one publisher go to the same member
+#define MINE_GROUP_LEAVE        2 // cancel membership
+
+// flags of event registration
+#define MINE_REG_CONFLATE       1 // only the newest undelivered message of the event is kept
+
+// capabilities, negotiated by hello
+#define MINE_CAP_COMPACT        1 // event, varint length and data in one frame
+#define MINE_CAP_EVENT_ID       2 // event names interned to numeric ids per connection
+#define MINE_CAP_SUBSCRIBE      4 // many registrations in one frame and unregistration
+#define MINE_CAP_GROUP          8 // queue groups, each message goes to one member
+#define MINE_CAP_CONFLATE      16 // registration flags with conflation
+#define MINE_CAP_JOURNAL       32 // registration from journal sequence number
+
+// capabilities supported by this implementation
+#define MINE_CAPS               (MINE_CAP_COMPACT | MINE_CAP_EVENT_ID | MINE_CAP_SUBSCRIBE | MINE_CAP_GROUP | MINE_CAP_CONFLATE | MINE_CAP_JOURNAL)
 
 #define MINE_CHUNK_SIZE      1024
+#define MINE_RBUF_SIZE       65536
+#define MINE_PIPE_SIZE       65536
+#define MINE_SSL_RECORD_SIZE 16384
+
+#define MINE_RECV_WHOLE      1
+#define MINE_CTX_SESSIONS    16
+#define MINE_SND_IDS         256 // events interned for sending, power of 2
+#define MINE_HEADER_SIZE     (1+3+1+255 + 2+255+10) // event id definition, event and data length
+
+#define MINE_WANT_READ       1
+#define MINE_WANT_WRITE      2
+
+#define MINE_SHM_MAGIC       0x4D494E45 // MINE
+#define MINE_SHM_HDR_SIZE    4096
+#define MINE_SHM_WRITING     0
+#define MINE_SHM_READY       1
+#define MINE_SHM_SKIP        2
+#define MINE_SHM_DROPPED     3
+
+#define MINE_STATE_NONE       0
+#define MINE_STATE_CONNECTING 1
+#define MINE_STATE_GREETING   2
+#define MINE_STATE_HANDSHAKE  3
+#define MINE_STATE_CONNECTED  4
+#define MINE_STATE_LOGIN      5
 
 char MINE_SSL_LOADED = 0;
 
+// varint used by the compact frame is perl's BER compressed integer (pack 'w'):
+// 7 bits per byte, most significant first, high bit set on all bytes except last
+// returns number of bytes written to buf, at most 10
+static inline int _mine_varint_put(char *buf, uint64_t v) {
+	int n = 1, i;
+	uint64_t t;
+	
+	for (t = v >> 7; t; t >>= 7) {
+		n++;
+	}
+	for (i=n-1; i>=0; i--, v >>= 7) {
+		buf[i] = (v & 0x7F) | (i == n-1 ? 0 : 0x80);
+	}
+	
+	return n;
+}
+
+// returns number of bytes readed from buf, 0 if varint is incomplete and -1 if it is too long
+static inline int _mine_varint_get(const unsigned char *buf, size_t len, uint64_t *v) {
+	size_t i;
+	
+	*v = 0;
+	for (i=0; i<len && i<10; i++) {
+		*v = (*v << 7) | (buf[i] & 0x7F);
+		if (!(buf[i] & 0x80)) {
+			return i + 1;
+		}
+	}
+	
+	return i == 10 ? -1 : 0;
+}
+
+typedef struct {
+	SSL_CTX *ssl_ctx;
+	struct sockaddr_storage peers[MINE_CTX_SESSIONS];
+	SSL_SESSION *sessions[MINE_CTX_SESSIONS];
+	unsigned int next;
+} MINE_CTX;
+
 typedef struct {
 	int sock;
 	SSL *ssl;
 	SSL_CTX *ctx;
+	MINE_CTX *mctx;
 	int err;
 	const char *errstr;
 	char *snd_event;
 	char *rcv_event;
+	int snd_id;       // id of snd_event, -1 if it has no id
+	char **snd_ids;   // interned names, id is index of the slot
+	size_t snd_nids;
+	char **rcv_ids;   // names defined by the server, indexed by id
+	size_t rcv_nids;
 	int64_t snd_datalen;
 	int64_t rcv_datalen;
 	int64_t cur_datalen;
+	uint64_t rcv_seq;  // journal sequence number of the received message, 0 if unknown
+	uint64_t next_seq; // received before the header of the next message
 	char readed;
+	char version;
+	uint32_t caps;
+	char nonblock;
+	char state;
+	char wants;
+	char *wbuf;
+	size_t wlen;
+	size_t woff;
+	size_t wcap;
+	char *rbuf;
+	size_t rpos;
+	size_t rlen;
+	size_t rcv_have;
+	int pipe[2];
 } MINE;
 
+// whole message for mine_event_send_batch()
+typedef struct {
+	char *event;
+	char *data;
+	int64_t datalen;
+} MINE_MSG;
+
+// shared memory ring written by mined, see main.cfg shm_path
+// ring of size bytes follows header of MINE_SHM_HDR_SIZE bytes
+// positions grow infinitely, position in the ring is pos % size
+typedef struct {
+	uint32_t magic;
+	uint32_t futex;   // incremented after frames became ready
+	uint64_t size;
+	uint64_t head;    // end of the last frame
+	uint64_t tail;    // start of the oldest frame not overwritten yet
+} MINE_SHM_HDR;
+
+// frame is followed by event, '\0' and data, frames never wrap
+typedef struct {
+	uint32_t len;     // whole frame length, multiple of 8
+	uint32_t state;   // MINE_SHM_WRITING, MINE_SHM_READY, MINE_SHM_SKIP or MINE_SHM_DROPPED
+	uint32_t host;    // sender ip, network order
+	uint32_t elen;
+	int64_t datalen;
+} MINE_SHM_FRAME;
+
+typedef struct {
+	MINE_SHM_HDR *hdr;
+	char *ring;
+	size_t maplen;
+	uint64_t pos;
+	uint64_t frame;   // position of the last received frame
+	uint64_t lost;
+	uint32_t host;
+	int err;
+	const char *errstr;
+} MINE_SHM;
+
+MINE_CTX *mine_ctx_new();
+void mine_ctx_free(MINE_CTX *self);
+void mine_set_ctx(MINE *self, MINE_CTX *ctx);
 MINE *mine_new();
 void mine_destroy(MINE *self);
 char mine_connect(MINE *self, char *host, uint16_t port);
+char mine_connect_unix(MINE *self, char *path);
 char mine_disconnect(MINE *self);
 char mine_login(MINE *self, char *login, char *password);
 char mine_event_reg(MINE *self, char *event, char *ip);
+char mine_event_reg_multi(MINE *self, char **events, size_t n, char *ip);
+char mine_event_unreg(MINE *self, char *event, char *ip);
+char mine_event_reg_group(MINE *self, char *event, char *ip, char *group, int flags);
+char mine_event_reg_flags(MINE *self, char *event, char *ip, int flags);
+char mine_event_reg_from(MINE *self, char *event, char *ip, uint64_t seq);
 char mine_event_send(MINE *self, char *event, int64_t datalen, int chunklen, char *data);
+char mine_event_send_batch(MINE *self, const MINE_MSG *msgs, size_t n);
+char mine_event_send_fd(MINE *self, char *event, int fd, off_t off, int64_t len);
 int mine_event_recv(MINE *self, char **event, int64_t *datalen, char *buf);
+int64_t mine_event_recv_buf(MINE *self, char **event, int64_t *datalen, char *buf, size_t size, int flags);
+int64_t mine_event_recv_to_fd(MINE *self, char **event, int64_t *datalen, int fd);
+char mine_set_nonblock(MINE *self, char nonblock);
+int mine_fd(MINE *self);
+int mine_wants(MINE *self);
+char mine_flush(MINE *self);
+MINE_SHM *mine_shm_attach(const char *path);
+void mine_shm_detach(MINE_SHM *self);
+int64_t mine_shm_recv(MINE_SHM *self, char **event, char **data, int timeout);
+char mine_shm_valid(MINE_SHM *self);
 
 #endif // MINE_H
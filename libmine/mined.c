@@ -0,0 +1,3745 @@
+/*
+ * mined - native mine server
+ *
+ * Speaks the same protocol as Mine::Server (see lib/Mine/Server.pm) and reads
+ * the same main.cfg, users.cfg and hosts.cfg, so libmine and mine-cl clients
+ * could be used with it unchanged. Actions from actions.cfg are handled by perl
+ * plugins and are not supported here.
+ *
+ * Usage: mined [-c config_dir] [-k cert_dir]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include "mine.h"
+
+#define MINED_CONFIG_PATH "tmp/cfg"
+#define MINED_CERT_PATH   "tmp/cert"
+#define MINED_DEFAULT_PORT 1135
+#define MINED_SSL_SESSION_CACHE 1024
+#define MINED_SHM_SIZE    (64*1024*1024)
+#define MINED_OUT_QUEUE_LIMIT (64*1024*1024)
+#define MINED_LAST_VALUE_SIZE  (64*1024)
+#define MINED_LAST_VALUE_LIMIT (16*1024*1024)
+#define MINED_JOURNAL_SEGMENT  (64*1024*1024)
+#define MINED_JOURNAL_SEGMENTS 16
+#define MINED_JOURNAL_SYNC     100        // ms between fsync of the journal
+#define MINED_JOURNAL_INDEX    (1024*1024) // records in one segment at most
+#define MINED_JOURNAL_BUF      (256*1024)  // records written at once, also queue of catching up client
+#define MINED_JOURNAL_SCAN     4096       // records read for catching up client at once
+#define MINED_JOURNAL_HDR      22         // seq, host, state, elen and datalen
+
+// state of the journal record
+#define MINED_RECORD_PENDING  0 // data is still coming
+#define MINED_RECORD_COMPLETE 1
+#define MINED_RECORD_DROPPED  2 // publisher disconnected in the middle of data
+
+// out_queue_policy, what to do with message which does not fit the queue
+#define MINED_POLICY_DISCONNECT  0
+#define MINED_POLICY_DROP_OLDEST 1
+#define MINED_POLICY_DROP_NEWEST 2
+#define MINED_POLICY_SPILL       3
+
+// capabilities supported by the server
+#define MINED_CAPS        (MINE_CAP_COMPACT | MINE_CAP_EVENT_ID | MINE_CAP_SUBSCRIBE | MINE_CAP_GROUP | MINE_CAP_CONFLATE)
+
+#define MINED_RBUF_SIZE   65536
+#define MINED_MAX_EVENTS  256
+#define MINED_EVENTS_SIZE 4096 // buckets of interned event names, power of 2
+
+#define MINED_STATE_HANDSHAKE 0xFF
+
+#define MINED_JSON_NULL   0
+#define MINED_JSON_BOOL   1
+#define MINED_JSON_NUMBER 2
+#define MINED_JSON_STRING 3
+#define MINED_JSON_ARRAY  4
+#define MINED_JSON_OBJECT 5
+
+char MINED_DEBUG = 0;
+volatile sig_atomic_t MINED_DUMP = 0; // SIGUSR1 asks to print output queues
+
+#define DEBUG(...) if (MINED_DEBUG) fprintf(stderr, __VA_ARGS__)
+
+typedef struct MINED_JSON {
+	char type;
+	char *str;
+	double num;
+	size_t len;
+	char **keys;
+	struct MINED_JSON **items;
+} MINED_JSON;
+
+typedef struct MINED_CONN MINED_CONN;
+
+typedef struct {
+	MINED_CONN *conn;
+	uint64_t seq;
+	uint64_t skip; // msg_seq of the publisher message which was not accepted
+	char conflate; // only the newest undelivered message is kept
+	uint64_t from; // next journal record while catching up, 0 when messages come as usual
+	size_t ci;  // index in conn->subs
+} MINED_SUBSCRIBER;
+
+// queue group, each message of the topic goes to one of its members
+typedef struct MINED_GROUP {
+	struct MINED_GROUP *next;
+	uint64_t id;
+	char sticky;
+	size_t rr;  // where search of the least loaded member starts
+	unsigned char glen;
+	char name[255];
+	MINED_SUBSCRIBER *subs;
+	size_t nsubs;
+	size_t cap;
+} MINED_GROUP;
+
+typedef struct MINED_TOPIC {
+	struct MINED_TOPIC *next;
+	uint32_t hash;
+	size_t klen;
+	char key[4+255];
+	MINED_SUBSCRIBER *subs;
+	size_t nsubs;
+	size_t cap;
+	MINED_GROUP *groups;
+} MINED_TOPIC;
+
+// subscription of the connection, idx is index in topic->subs
+// or group->subs, so both sides could be removed without search
+typedef struct {
+	MINED_TOPIC *topic;
+	MINED_GROUP *group; // NULL if it is not membership in queue group
+	size_t idx;
+} MINED_SUBSCRIPTION;
+
+// member of the queue group which gets the current message of the publisher,
+// idx is only a hint, because members move when somebody leaves
+typedef struct {
+	uint64_t group;
+	uint64_t seq;
+	size_t idx;
+} MINED_PICK;
+
+// where queued message starts in the output stream of the connection,
+// pinned one defines event id, so it should not be dropped
+// conflated message also knows its end and subscription seq as key
+typedef struct {
+	uint64_t pos;
+	uint64_t end;
+	uint64_t key;
+	char pinned;
+} MINED_MARK;
+
+// last complete message of the publisher, replayed to new subscribers
+// of the event, all values are also listed in order of update
+typedef struct MINED_VALUE {
+	struct MINED_VALUE *next; // next value of the same event
+	struct MINED_VALUE *lru_prev;
+	struct MINED_VALUE *lru_next;
+	struct MINED_EVENT *ev;
+	uint32_t host;
+	size_t len;
+	char data[];
+} MINED_VALUE;
+
+// event name interned by the server, never freed
+// gid is used as event id for all subscribers
+typedef struct MINED_EVENT {
+	struct MINED_EVENT *next;
+	uint32_t hash;
+	uint32_t gid;
+	char last_value;     // listed in last_value_events
+	MINED_VALUE *values;
+	unsigned char elen;
+	char name[255];
+} MINED_EVENT;
+
+// where events of the publisher go, topics are valid while gen is
+// equal to the server topics_gen, so no lookups while nobody subscribes
+typedef struct {
+	MINED_EVENT *ev;
+	MINED_TOPIC *topics[2];
+	uint64_t gen;
+} MINED_ROUTE;
+
+typedef struct MINED_STR {
+	struct MINED_STR *next;
+	uint32_t hash;
+	char *key;
+	char *value;
+} MINED_STR;
+
+struct MINED_CONN {
+	int fd;
+	uint64_t id;
+	SSL *ssl;
+	unsigned char state;
+	char dead;
+	uint32_t host;
+	char user[256];
+	char event[256];
+	unsigned char elen;
+	int64_t datalen;
+	char first;
+	MINED_ROUTE *route;   // route of the current event
+	MINED_ROUTE str_route; // for events sent by name
+	MINED_ROUTE *routes;  // indexed by event id defined by the client
+	size_t nroutes;
+	char *out_ids;        // indexed by gid, 1 if id already defined for the client
+	size_t nout_ids;
+	uint64_t msg_seq;
+	MINED_VALUE *lv;      // current message, while it is collected for the cache
+	uint64_t jseq;        // journal record of the current message, 0 if it is not journaled
+	uint64_t msg_jseq;    // the same, but kept until the first chunk is sent to subscribers
+	uint64_t jseg;        // segment of the record
+	uint64_t jrec;        // offset of the record in the segment
+	uint64_t jpos;        // where the next data goes
+	uint64_t jleft;
+	int jwfd;             // segment of the record, if it is not the current one any more
+	char want_seq;        // registered from journal, so sequence of each message is sent
+	char catching;        // some subscriptions are catching up from the journal
+	uint64_t jcur;        // next journal record to check for them
+	uint64_t jrfirst;     // segment opened for reading
+	uint64_t *jridx;
+	int jrfd;
+	char version;
+	uint32_t caps;
+	unsigned char rbuf[MINED_RBUF_SIZE];
+	size_t rlen;
+	char *wbuf;
+	size_t wlen;
+	size_t woff;
+	size_t wcap;
+	uint64_t qpos;        // stream position of wbuf+woff, bytes written to the socket
+	MINED_MARK *marks;    // queued messages, for drop_oldest
+	size_t mhead;
+	size_t nmarks;
+	size_t marks_cap;
+	int spill_fd;         // the rest of the queue is on the disk
+	uint64_t spill_rd;
+	uint64_t spill_wr;
+	uint64_t peak;
+	uint64_t dropped;
+	uint64_t spilled;
+	uint64_t conflated;
+	MINED_SUBSCRIPTION *subs;
+	size_t nsubs;
+	size_t subs_cap;
+	uint64_t regs_left;   // registrations remaining in multi registration frame
+	MINED_PICK *picks;    // queue group members chosen for the current message
+	size_t npicks;
+	size_t picks_cap;
+	char shm_active;
+	uint64_t shm_pos;
+	size_t shm_off;
+	int64_t shm_left;
+	MINED_CONN *next_dead;
+	MINED_CONN *prev;
+	MINED_CONN *next;
+};
+
+typedef struct {
+	char *bind_address;
+	uint16_t bind_port;
+	char ssl;
+	long ssl_session_cache;
+	char ipauth;
+	char *unix_path;
+	char *shm_path;
+	uint64_t shm_size;
+	uint64_t out_limit;
+	char out_policy;
+	char *spill_path;
+	uint64_t lv_size;     // biggest cached last value
+	uint64_t lv_limit;
+	uint64_t lv_bytes;
+	size_t nvalues;
+	char lv_events;       // some events are cached
+	MINED_VALUE *lv_head; // least recently updated
+	MINED_VALUE *lv_tail;
+	char *jpath;          // journal is off if it is NULL
+	uint64_t jseg_size;
+	size_t jseg_max;
+	uint64_t jsync;
+	int jfd;              // current segment, -1 if it could not be opened
+	uint64_t *jidx;       // mmaped index of the current segment
+	uint64_t jfirst;      // record which starts the current segment
+	uint64_t jnext;
+	uint64_t jstart;      // jnext at startup, earlier pending records are lost
+	uint64_t jsize;       // end of the last reserved record
+	char *jbuf;           // end of the segment not written yet
+	uint64_t jbuf_off;
+	size_t jbuf_len;
+	char jdirty;          // written since the last fsync
+	char jbusy;           // somebody could catch up more right now
+	uint64_t jsynced;
+	uint64_t *jsegs;      // first records of the segments on the disk
+	size_t njsegs;
+	size_t jsegs_cap;
+	size_t ncatching;
+	MINE_SHM_HDR *shm;
+	char *shm_ring;
+	char shm_wake;
+	MINED_STR **users;
+	size_t users_size;
+	uint32_t *hosts;
+	size_t nhosts;
+	uint32_t *netmask;
+	size_t nnetmask;
+	SSL_CTX *ctx;
+	int epfd;
+	int lsock;
+	int usock;
+	MINED_TOPIC **topics;
+	size_t topics_size;
+	size_t ntopics;
+	uint64_t topics_gen;
+	MINED_EVENT *events[MINED_EVENTS_SIZE];
+	MINED_EVENT **event_ids;
+	size_t nevents;
+	uint64_t seq;
+	MINED_CONN *conns;
+	MINED_CONN *dead;
+} MINED;
+
+static void mined_conn_close(MINED *self, MINED_CONN *conn);
+static MINED_EVENT *mined_event_intern(MINED *self, const char *name, unsigned char elen);
+
+static void mined_warn(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "mined: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+}
+
+static uint32_t mined_hash(const char *key, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	
+	for (i=0; i<len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	
+	return h;
+}
+
+// json
+
+static void mined_json_free(MINED_JSON *node) {
+	size_t i;
+	
+	if (!node) {
+		return;
+	}
+	
+	for (i=0; i<node->len; i++) {
+		if (node->keys) free(node->keys[i]);
+		if (node->items) mined_json_free(node->items[i]);
+	}
+	
+	free(node->keys);
+	free(node->items);
+	free(node->str);
+	free(node);
+}
+
+static void mined_json_ws(const char **p) {
+	while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') {
+		(*p)++;
+	}
+}
+
+static char *mined_json_parse_string(const char **p) {
+	size_t cap = 16, len = 0;
+	char *str;
+	
+	if (**p != '"') {
+		return NULL;
+	}
+	(*p)++;
+	
+	str = malloc(cap);
+	if (!str) {
+		return NULL;
+	}
+	
+	while (**p != '"') {
+		unsigned int c = (unsigned char)**p;
+		
+		if (c == '\0') {
+			goto MINED_JSON_STRING_ERROR;
+		}
+		
+		if (c == '\\') {
+			(*p)++;
+			switch (**p) {
+				case '"':  c = '"';  break;
+				case '\\': c = '\\'; break;
+				case '/':  c = '/';  break;
+				case 'b':  c = '\b'; break;
+				case 'f':  c = '\f'; break;
+				case 'n':  c = '\n'; break;
+				case 'r':  c = '\r'; break;
+				case 't':  c = '\t'; break;
+				case 'u':
+					// exactly 4 hex digits, sscanf() would take less of them
+					if (!isxdigit((unsigned char)(*p)[1]) || !isxdigit((unsigned char)(*p)[2]) ||
+					    !isxdigit((unsigned char)(*p)[3]) || !isxdigit((unsigned char)(*p)[4])) {
+						goto MINED_JSON_STRING_ERROR;
+					}
+					sscanf(*p+1, "%4x", &c);
+					*p += 4;
+					break;
+				default:
+					goto MINED_JSON_STRING_ERROR;
+			}
+		}
+		(*p)++;
+		
+		if (len + 4 >= cap) {
+			char *tmp = realloc(str, cap *= 2);
+			if (!tmp) {
+				goto MINED_JSON_STRING_ERROR;
+			}
+			str = tmp;
+		}
+		
+		// utf-8 encode escaped code points, other bytes copied as is
+		if (c < 0x80) {
+			str[len++] = c;
+		}
+		else if (c < 0x800) {
+			str[len++] = 0xC0 | (c >> 6);
+			str[len++] = 0x80 | (c & 0x3F);
+		}
+		else {
+			str[len++] = 0xE0 | (c >> 12);
+			str[len++] = 0x80 | ((c >> 6) & 0x3F);
+			str[len++] = 0x80 | (c & 0x3F);
+		}
+	}
+	(*p)++;
+	
+	str[len] = '\0';
+	return str;
+	
+	MINED_JSON_STRING_ERROR:
+		free(str);
+		return NULL;
+}
+
+static MINED_JSON *mined_json_parse_value(const char **p, int depth) {
+	MINED_JSON *node;
+	char *end;
+	
+	if (depth > 64) {
+		return NULL;
+	}
+	
+	node = calloc(1, sizeof(MINED_JSON));
+	if (!node) {
+		return NULL;
+	}
+	
+	mined_json_ws(p);
+	switch (**p) {
+		case '{':
+		case '[': {
+			char is_obj = **p == '{';
+			char close = is_obj ? '}' : ']';
+			size_t cap = 0;
+			
+			node->type = is_obj ? MINED_JSON_OBJECT : MINED_JSON_ARRAY;
+			(*p)++;
+			mined_json_ws(p);
+			if (**p == close) {
+				(*p)++;
+				break;
+			}
+			
+			while (1) {
+				if (node->len == cap) {
+					cap = cap ? cap * 2 : 8;
+					MINED_JSON **items = realloc(node->items, cap * sizeof(MINED_JSON*));
+					if (!items) goto MINED_JSON_VALUE_ERROR;
+					node->items = items;
+					
+					if (is_obj) {
+						char **keys = realloc(node->keys, cap * sizeof(char*));
+						if (!keys) goto MINED_JSON_VALUE_ERROR;
+						node->keys = keys;
+					}
+				}
+				
+				if (is_obj) {
+					mined_json_ws(p);
+					node->keys[node->len] = mined_json_parse_string(p);
+					if (!node->keys[node->len]) goto MINED_JSON_VALUE_ERROR;
+					mined_json_ws(p);
+					if (**p != ':') {
+						free(node->keys[node->len]);
+						goto MINED_JSON_VALUE_ERROR;
+					}
+					(*p)++;
+				}
+				
+				node->items[node->len] = mined_json_parse_value(p, depth+1);
+				if (!node->items[node->len]) {
+					if (is_obj) free(node->keys[node->len]);
+					goto MINED_JSON_VALUE_ERROR;
+				}
+				node->len++;
+				
+				mined_json_ws(p);
+				if (**p == ',') {
+					(*p)++;
+				}
+				else if (**p == close) {
+					(*p)++;
+					break;
+				}
+				else {
+					goto MINED_JSON_VALUE_ERROR;
+				}
+			}
+			break;
+		}
+		case '"':
+			node->type = MINED_JSON_STRING;
+			node->str = mined_json_parse_string(p);
+			if (!node->str) goto MINED_JSON_VALUE_ERROR;
+			break;
+		case 't':
+		case 'f':
+		case 'n':
+			if (strncmp(*p, "true", 4) == 0) {
+				node->type = MINED_JSON_BOOL;
+				node->num = 1;
+				*p += 4;
+			}
+			else if (strncmp(*p, "false", 5) == 0) {
+				node->type = MINED_JSON_BOOL;
+				*p += 5;
+			}
+			else if (strncmp(*p, "null", 4) == 0) {
+				node->type = MINED_JSON_NULL;
+				*p += 4;
+			}
+			else {
+				goto MINED_JSON_VALUE_ERROR;
+			}
+			break;
+		default:
+			node->type = MINED_JSON_NUMBER;
+			node->num = strtod(*p, &end);
+			if (end == *p) goto MINED_JSON_VALUE_ERROR;
+			*p = end;
+	}
+	
+	return node;
+	
+	MINED_JSON_VALUE_ERROR:
+		mined_json_free(node);
+		return NULL;
+}
+
+static MINED_JSON *mined_json_load(const char *path) {
+	FILE *fh;
+	long size;
+	char *text;
+	const char *p;
+	MINED_JSON *root;
+	
+	fh = fopen(path, "r");
+	if (!fh) {
+		mined_warn("%s: %s", path, strerror(errno));
+		return NULL;
+	}
+	
+	fseek(fh, 0, SEEK_END);
+	size = ftell(fh);
+	rewind(fh);
+	
+	text = malloc(size+1);
+	if (!text || fread(text, 1, size, fh) != (size_t)size) {
+		mined_warn("%s: %s", path, strerror(errno));
+		free(text);
+		fclose(fh);
+		return NULL;
+	}
+	text[size] = '\0';
+	fclose(fh);
+	
+	p = text;
+	root = mined_json_parse_value(&p, 0);
+	if (root) {
+		mined_json_ws(&p);
+		if (*p != '\0') {
+			mined_json_free(root);
+			root = NULL;
+		}
+	}
+	
+	if (!root) {
+		mined_warn("%s: malformed JSON", path);
+	}
+	
+	free(text);
+	return root;
+}
+
+static MINED_JSON *mined_json_get(MINED_JSON *obj, const char *key) {
+	size_t i;
+	
+	if (!obj || obj->type != MINED_JSON_OBJECT) {
+		return NULL;
+	}
+	
+	for (i=0; i<obj->len; i++) {
+		if (strcmp(obj->keys[i], key) == 0) {
+			return obj->items[i];
+		}
+	}
+	
+	return NULL;
+}
+
+// config
+
+static char mined_host2long(const char *host, uint32_t *ip) {
+	struct in_addr addr;
+	struct hostent *hostinfo;
+	
+	if (inet_aton(host, &addr)) {
+		*ip = ntohl(addr.s_addr);
+		return 1;
+	}
+	
+	hostinfo = gethostbyname(host);
+	if (!hostinfo || hostinfo->h_addrtype != AF_INET) {
+		return 0;
+	}
+	
+	*ip = ntohl(((struct in_addr *)hostinfo->h_addr)->s_addr);
+	return 1;
+}
+
+static const char *mined_user_password(MINED *self, const char *login) {
+	MINED_STR *entry;
+	uint32_t hash;
+	
+	if (!self->users_size) {
+		return NULL;
+	}
+	
+	hash = mined_hash(login, strlen(login));
+	for (entry = self->users[hash & (self->users_size-1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, login) == 0) {
+			return entry->value;
+		}
+	}
+	
+	return NULL;
+}
+
+static void mined_load_main(MINED *self, const char *cfgdir) {
+	char path[PATH_MAX];
+	MINED_JSON *root, *elt;
+	
+	self->bind_address = strdup("0.0.0.0");
+	self->bind_port = MINED_DEFAULT_PORT;
+	self->ssl = 0;
+	self->ssl_session_cache = MINED_SSL_SESSION_CACHE;
+	self->ipauth = 0;
+	self->shm_size = MINED_SHM_SIZE;
+	self->out_limit = MINED_OUT_QUEUE_LIMIT;
+	self->out_policy = MINED_POLICY_DISCONNECT;
+	self->lv_size = MINED_LAST_VALUE_SIZE;
+	self->lv_limit = MINED_LAST_VALUE_LIMIT;
+	self->jseg_size = MINED_JOURNAL_SEGMENT;
+	self->jseg_max = MINED_JOURNAL_SEGMENTS;
+	self->jsync = MINED_JOURNAL_SYNC;
+	self->jfd = -1;
+	
+	snprintf(path, sizeof(path), "%s/main.cfg", cfgdir);
+	root = mined_json_load(path);
+	if (!root || root->type != MINED_JSON_OBJECT) {
+		mined_warn("main.cfg: using default");
+		mined_json_free(root);
+		return;
+	}
+	
+	if ((elt = mined_json_get(root, "bind_address")) && elt->type == MINED_JSON_STRING) {
+		free(self->bind_address);
+		self->bind_address = strdup(elt->str);
+	}
+	
+	if ((elt = mined_json_get(root, "bind_port"))) {
+		// mine-adm stores port as string
+		long port = elt->type == MINED_JSON_STRING ? strtol(elt->str, NULL, 10) : (long)elt->num;
+		if (port > 0 && port < 65536) {
+			self->bind_port = port;
+		}
+		else {
+			mined_warn("main.cfg: `bind_port' should be > 0 and < 65536");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "ssl")) && elt->type == MINED_JSON_BOOL) {
+		self->ssl = elt->num != 0;
+	}
+	
+	if ((elt = mined_json_get(root, "ssl_session_cache"))) {
+		long size = elt->type == MINED_JSON_STRING ? strtol(elt->str, NULL, 10) : (long)elt->num;
+		if (size >= 0) {
+			self->ssl_session_cache = size;
+		}
+		else {
+			mined_warn("main.cfg: `ssl_session_cache' should be numeric");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "ipauth")) && elt->type == MINED_JSON_BOOL) {
+		self->ipauth = elt->num != 0;
+	}
+	
+	if ((elt = mined_json_get(root, "unix_path")) && elt->type == MINED_JSON_STRING && *elt->str) {
+		self->unix_path = strdup(elt->str);
+	}
+	
+	if ((elt = mined_json_get(root, "shm_path")) && elt->type == MINED_JSON_STRING && *elt->str) {
+		self->shm_path = strdup(elt->str);
+	}
+	
+	if ((elt = mined_json_get(root, "shm_size"))) {
+		long long size = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (size >= 4096) {
+			// frames are aligned to 8 bytes
+			self->shm_size = size & ~7LL;
+		}
+		else {
+			mined_warn("main.cfg: `shm_size' should be >= 4096");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "out_queue_limit"))) {
+		long long limit = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (limit >= 0) {
+			self->out_limit = limit;
+		}
+		else {
+			mined_warn("main.cfg: `out_queue_limit' should be numeric");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "out_queue_policy"))) {
+		static const char *policies[] = {"disconnect", "drop_oldest", "drop_newest", "spill"};
+		int i;
+		
+		for (i=0; i<4; i++) {
+			if (elt->type == MINED_JSON_STRING && strcmp(elt->str, policies[i]) == 0) {
+				self->out_policy = i;
+				break;
+			}
+		}
+		if (i == 4) {
+			mined_warn("main.cfg: `out_queue_policy' should be disconnect, drop_oldest, drop_newest or spill");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "spill_path")) && elt->type == MINED_JSON_STRING && *elt->str) {
+		self->spill_path = strdup(elt->str);
+	}
+	
+	if ((elt = mined_json_get(root, "last_value_events")) && elt->type == MINED_JSON_ARRAY) {
+		size_t i;
+		
+		for (i=0; i<elt->len; i++) {
+			MINED_EVENT *ev;
+			
+			if (elt->items[i]->type != MINED_JSON_STRING || !*elt->items[i]->str || strlen(elt->items[i]->str) > 255) {
+				mined_warn("main.cfg: `last_value_events' should be an array of event names");
+				continue;
+			}
+			
+			// interned now, so cached events are found by name
+			if ((ev = mined_event_intern(self, elt->items[i]->str, strlen(elt->items[i]->str)))) {
+				ev->last_value = 1;
+				self->lv_events = 1;
+			}
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "last_value_size"))) {
+		long long size = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (size >= 0) {
+			self->lv_size = size;
+		}
+		else {
+			mined_warn("main.cfg: `last_value_size' should be numeric");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "last_value_limit"))) {
+		long long limit = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (limit >= 0) {
+			self->lv_limit = limit;
+		}
+		else {
+			mined_warn("main.cfg: `last_value_limit' should be numeric");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "journal_path")) && elt->type == MINED_JSON_STRING && *elt->str) {
+		self->jpath = strdup(elt->str);
+	}
+	
+	if ((elt = mined_json_get(root, "journal_segment_size"))) {
+		long long size = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (size >= 4096) {
+			self->jseg_size = size;
+		}
+		else {
+			mined_warn("main.cfg: `journal_segment_size' should be >= 4096");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "journal_segments"))) {
+		long long n = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (n >= 0) {
+			self->jseg_max = n;
+		}
+		else {
+			mined_warn("main.cfg: `journal_segments' should be numeric");
+		}
+	}
+	
+	if ((elt = mined_json_get(root, "journal_sync"))) {
+		long long ms = elt->type == MINED_JSON_STRING ? strtoll(elt->str, NULL, 10) : (long long)elt->num;
+		if (ms >= 0) {
+			self->jsync = ms;
+		}
+		else {
+			mined_warn("main.cfg: `journal_sync' should be numeric");
+		}
+	}
+	
+	mined_json_free(root);
+}
+
+static void mined_load_users(MINED *self, const char *cfgdir) {
+	char path[PATH_MAX];
+	MINED_JSON *root;
+	size_t i;
+	
+	snprintf(path, sizeof(path), "%s/users.cfg", cfgdir);
+	root = mined_json_load(path);
+	if (!root || root->type != MINED_JSON_OBJECT) {
+		mined_warn("users.cfg: using default");
+		mined_json_free(root);
+		return;
+	}
+	
+	self->users_size = 16;
+	while (self->users_size < root->len) {
+		self->users_size <<= 1;
+	}
+	self->users = calloc(self->users_size, sizeof(MINED_STR*));
+	
+	for (i=0; self->users && i<root->len; i++) {
+		MINED_STR *entry;
+		
+		if (root->items[i]->type != MINED_JSON_STRING) {
+			continue;
+		}
+		
+		entry = malloc(sizeof(MINED_STR));
+		if (!entry) {
+			break;
+		}
+		
+		entry->key   = strdup(root->keys[i]);
+		entry->value = strdup(root->items[i]->str);
+		entry->hash  = mined_hash(entry->key, strlen(entry->key));
+		entry->next  = self->users[entry->hash & (self->users_size-1)];
+		self->users[entry->hash & (self->users_size-1)] = entry;
+	}
+	
+	mined_json_free(root);
+}
+
+static void mined_load_hosts(MINED *self, const char *cfgdir) {
+	char path[PATH_MAX];
+	MINED_JSON *root;
+	size_t i;
+	
+	snprintf(path, sizeof(path), "%s/hosts.cfg", cfgdir);
+	root = mined_json_load(path);
+	if (!root || root->type != MINED_JSON_ARRAY) {
+		mined_warn("hosts.cfg: using default");
+		mined_json_free(root);
+		return;
+	}
+	
+	self->hosts   = malloc(root->len * sizeof(uint32_t) + 1);
+	self->netmask = malloc(root->len * 2 * sizeof(uint32_t) + 1);
+	
+	for (i=0; self->hosts && self->netmask && i<root->len; i++) {
+		char *elt, *slash;
+		uint32_t ip;
+		
+		if (root->items[i]->type != MINED_JSON_STRING) {
+			continue;
+		}
+		
+		elt = root->items[i]->str;
+		if ((slash = strchr(elt, '/'))) {
+			// net + cidr form
+			int cidr = atoi(slash+1);
+			*slash = '\0';
+			if (mined_host2long(elt, &ip)) {
+				uint32_t mask = cidr <= 0 ? 0 : cidr >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> cidr);
+				
+				// host bits of the net are ignored, like by Mine::Utils::IPTrie
+				self->netmask[self->nnetmask++] = ip & mask;
+				self->netmask[self->nnetmask++] = mask;
+			}
+		}
+		else if (mined_host2long(elt, &ip)) {
+			self->hosts[self->nhosts++] = ip;
+		}
+	}
+	
+	mined_json_free(root);
+}
+
+static void mined_load_actions(const char *cfgdir) {
+	char path[PATH_MAX];
+	MINED_JSON *root;
+	
+	snprintf(path, sizeof(path), "%s/actions.cfg", cfgdir);
+	if (access(path, R_OK) != 0) {
+		return;
+	}
+	
+	root = mined_json_load(path);
+	if (root && root->type == MINED_JSON_ARRAY && root->len > 0) {
+		mined_warn("actions.cfg: actions are not supported, ignored");
+	}
+	
+	mined_json_free(root);
+}
+
+// authorization
+
+static char mined_can_auth(MINED *self, uint32_t host, const char *login, const char *password) {
+	DEBUG("mined_can_auth(%08x, %s, %s)\n", host, login, password);
+	
+	if (*login) {
+		const char *md5 = mined_user_password(self, login);
+		
+		if (md5) {
+			unsigned char digest[EVP_MAX_MD_SIZE];
+			unsigned int dlen, i;
+			char hex[EVP_MAX_MD_SIZE*2+1];
+			
+			EVP_Digest(password, strlen(password), digest, &dlen, EVP_md5(), NULL);
+			for (i=0; i<dlen; i++) {
+				sprintf(hex+i*2, "%02x", digest[i]);
+			}
+			
+			if (strcmp(md5, hex) == 0) {
+				// auth by password ok
+				return 1;
+			}
+		}
+	}
+	
+	if (!self->ipauth) {
+		// authorization by ip disabled
+		return 0;
+	}
+	
+	size_t i;
+	for (i=0; i<self->nhosts; i++) {
+		if (self->hosts[i] == host) {
+			return 1;
+		}
+	}
+	
+	for (i=0; i<self->nnetmask; i+=2) {
+		if ((host & self->netmask[i+1]) == self->netmask[i]) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+// topics
+
+static MINED_TOPIC *mined_topic_find(MINED *self, const char *key, size_t klen, char create) {
+	uint32_t hash = mined_hash(key, klen);
+	MINED_TOPIC *topic;
+	
+	if (self->topics_size) {
+		for (topic = self->topics[hash & (self->topics_size-1)]; topic; topic = topic->next) {
+			if (topic->hash == hash && topic->klen == klen && memcmp(topic->key, key, klen) == 0) {
+				return topic;
+			}
+		}
+	}
+	
+	if (!create) {
+		return NULL;
+	}
+	
+	if (self->ntopics >= self->topics_size) {
+		size_t size = self->topics_size ? self->topics_size * 2 : 64;
+		MINED_TOPIC **table = calloc(size, sizeof(MINED_TOPIC*));
+		size_t i;
+		
+		if (!table) {
+			return NULL;
+		}
+		
+		for (i=0; i<self->topics_size; i++) {
+			while ((topic = self->topics[i])) {
+				self->topics[i] = topic->next;
+				topic->next = table[topic->hash & (size-1)];
+				table[topic->hash & (size-1)] = topic;
+			}
+		}
+		
+		free(self->topics);
+		self->topics = table;
+		self->topics_size = size;
+	}
+	
+	topic = calloc(1, sizeof(MINED_TOPIC));
+	if (!topic) {
+		return NULL;
+	}
+	
+	topic->hash = hash;
+	topic->klen = klen;
+	memcpy(topic->key, key, klen);
+	topic->next = self->topics[hash & (self->topics_size-1)];
+	self->topics[hash & (self->topics_size-1)] = topic;
+	self->ntopics++;
+	self->topics_gen++;
+	
+	return topic;
+}
+
+static void mined_topic_del(MINED *self, MINED_TOPIC *topic) {
+	MINED_TOPIC **link = &self->topics[topic->hash & (self->topics_size-1)];
+	
+	while (*link != topic) {
+		link = &(*link)->next;
+	}
+	
+	*link = topic->next;
+	self->ntopics--;
+	self->topics_gen++;
+	free(topic->subs);
+	free(topic);
+}
+
+// queue group of the topic by name
+static MINED_GROUP *mined_group_find(MINED_TOPIC *topic, const char *name, unsigned char glen) {
+	MINED_GROUP *group;
+	
+	for (group = topic->groups; group; group = group->next) {
+		if (group->glen == glen && memcmp(group->name, name, glen) == 0) {
+			return group;
+		}
+	}
+	
+	return NULL;
+}
+
+static void mined_group_del(MINED_TOPIC *topic, MINED_GROUP *group) {
+	MINED_GROUP **link = &topic->groups;
+	
+	while (*link != group) {
+		link = &(*link)->next;
+	}
+	
+	*link = group->next;
+	free(group->subs);
+	free(group);
+}
+
+// subscribe connection to the topic with key, or make it member of the
+// queue group of the topic if name of the group is not NULL
+// returns 0 if out of memory, 2 if connection was not subscribed yet
+static char mined_subscribe(MINED *self, MINED_CONN *conn, const char *key, size_t klen,
+                            const char *name, unsigned char glen, char sticky, char conflate) {
+	MINED_TOPIC *topic;
+	MINED_GROUP *group = NULL;
+	MINED_SUBSCRIBER **subs;
+	size_t *nsubs, *cap;
+	size_t i;
+	
+	topic = mined_topic_find(self, key, klen, 1);
+	if (!topic) {
+		return 0;
+	}
+	
+	if (name) {
+		group = mined_group_find(topic, name, glen);
+		if (!group) {
+			group = calloc(1, sizeof(MINED_GROUP));
+			if (!group) {
+				return 0;
+			}
+			
+			// the first member decides how messages are distributed
+			group->id = ++self->seq;
+			group->sticky = sticky;
+			group->glen = glen;
+			memcpy(group->name, name, glen);
+			group->next = topic->groups;
+			topic->groups = group;
+		}
+		
+		subs  = &group->subs;
+		nsubs = &group->nsubs;
+		cap   = &group->cap;
+	}
+	else {
+		subs  = &topic->subs;
+		nsubs = &topic->nsubs;
+		cap   = &topic->cap;
+	}
+	
+	for (i=0; i<*nsubs; i++) {
+		if ((*subs)[i].conn == conn) {
+			// already registered, flags of the last registration are used
+			(*subs)[i].conflate = conflate;
+			return 1;
+		}
+	}
+	
+	if (*nsubs == *cap) {
+		size_t n = *cap ? *cap * 2 : 4;
+		MINED_SUBSCRIBER *grown = realloc(*subs, n * sizeof(MINED_SUBSCRIBER));
+		if (!grown) {
+			return 0;
+		}
+		*subs = grown;
+		*cap = n;
+	}
+	
+	if (conn->nsubs == conn->subs_cap) {
+		size_t n = conn->subs_cap ? conn->subs_cap * 2 : 4;
+		MINED_SUBSCRIPTION *grown = realloc(conn->subs, n * sizeof(MINED_SUBSCRIPTION));
+		if (!grown) {
+			return 0;
+		}
+		conn->subs = grown;
+		conn->subs_cap = n;
+	}
+	
+	conn->subs[conn->nsubs].topic = topic;
+	conn->subs[conn->nsubs].group = group;
+	conn->subs[conn->nsubs].idx   = *nsubs;
+	
+	(*subs)[*nsubs].conn = conn;
+	(*subs)[*nsubs].seq  = ++self->seq;
+	(*subs)[*nsubs].skip = 0;
+	(*subs)[*nsubs].conflate = conflate;
+	(*subs)[*nsubs].from = 0;
+	(*subs)[*nsubs].ci   = conn->nsubs++;
+	(*nsubs)++;
+	
+	return 2;
+}
+
+// remove subscription of the connection with index ci
+// last elements of both arrays are moved to the freed places
+static void mined_unsubscribe_at(MINED *self, MINED_CONN *conn, size_t ci) {
+	MINED_TOPIC *topic = conn->subs[ci].topic;
+	MINED_GROUP *group = conn->subs[ci].group;
+	MINED_SUBSCRIBER *subs = group ? group->subs : topic->subs;
+	size_t *nsubs = group ? &group->nsubs : &topic->nsubs;
+	size_t idx = conn->subs[ci].idx;
+	
+	subs[idx] = subs[--*nsubs];
+	if (idx < *nsubs) {
+		MINED_SUBSCRIBER *moved = &subs[idx];
+		moved->conn->subs[moved->ci].idx = idx;
+	}
+	
+	conn->subs[ci] = conn->subs[--conn->nsubs];
+	if (ci < conn->nsubs) {
+		MINED_SUBSCRIPTION *moved = &conn->subs[ci];
+		(moved->group ? moved->group->subs : moved->topic->subs)[moved->idx].ci = ci;
+	}
+	
+	if (group && group->nsubs == 0) {
+		mined_group_del(topic, group);
+	}
+	
+	if (topic->nsubs == 0 && !topic->groups) {
+		mined_topic_del(self, topic);
+	}
+}
+
+static void mined_unsubscribe(MINED *self, MINED_CONN *conn, const char *key, size_t klen,
+                              const char *name, unsigned char glen) {
+	MINED_TOPIC *topic = mined_topic_find(self, key, klen, 0);
+	MINED_SUBSCRIBER *subs;
+	size_t nsubs, i;
+	
+	if (!topic) {
+		return;
+	}
+	
+	if (name) {
+		MINED_GROUP *group = mined_group_find(topic, name, glen);
+		if (!group) {
+			return;
+		}
+		subs  = group->subs;
+		nsubs = group->nsubs;
+	}
+	else {
+		subs  = topic->subs;
+		nsubs = topic->nsubs;
+	}
+	
+	for (i=0; i<nsubs; i++) {
+		if (subs[i].conn == conn) {
+			mined_unsubscribe_at(self, conn, subs[i].ci);
+			return;
+		}
+	}
+}
+
+static void mined_unsubscribe_all(MINED *self, MINED_CONN *conn) {
+	while (conn->nsubs > 0) {
+		mined_unsubscribe_at(self, conn, conn->nsubs-1);
+	}
+	
+	free(conn->subs);
+	conn->subs = NULL;
+	conn->subs_cap = 0;
+}
+
+// event ids
+
+static MINED_EVENT *mined_event_find(MINED *self, const char *name, unsigned char elen, uint32_t hash) {
+	MINED_EVENT *ev;
+	
+	for (ev = self->events[hash & (MINED_EVENTS_SIZE-1)]; ev; ev = ev->next) {
+		if (ev->hash == hash && ev->elen == elen && memcmp(ev->name, name, elen) == 0) {
+			return ev;
+		}
+	}
+	
+	return NULL;
+}
+
+static MINED_EVENT *mined_event_intern(MINED *self, const char *name, unsigned char elen) {
+	uint32_t hash = mined_hash(name, elen);
+	MINED_EVENT *ev = mined_event_find(self, name, elen, hash);
+	
+	if (ev) {
+		return ev;
+	}
+	
+	if ((self->nevents & (self->nevents-1)) == 0) {
+		// grow ids array when number of events is power of 2
+		MINED_EVENT **ids = realloc(self->event_ids, (self->nevents ? self->nevents*2 : 64) * sizeof(MINED_EVENT*));
+		if (!ids) {
+			return NULL;
+		}
+		self->event_ids = ids;
+	}
+	
+	ev = malloc(sizeof(MINED_EVENT));
+	if (!ev) {
+		return NULL;
+	}
+	
+	ev->hash = hash;
+	ev->gid = self->nevents;
+	ev->last_value = 0;
+	ev->values = NULL;
+	ev->elen = elen;
+	memcpy(ev->name, name, elen);
+	ev->next = self->events[hash & (MINED_EVENTS_SIZE-1)];
+	self->events[hash & (MINED_EVENTS_SIZE-1)] = ev;
+	self->event_ids[self->nevents++] = ev;
+	
+	return ev;
+}
+
+// current event of the publisher is sent by name, so it is not interned yet
+static void mined_route_by_name(MINED_CONN *conn) {
+	conn->route = &conn->str_route;
+	conn->str_route.ev = NULL;
+	conn->str_route.gen = 0;
+}
+
+// find subscribers of the current event of the publisher
+static MINED_ROUTE *mined_route(MINED *self, MINED_CONN *conn) {
+	MINED_ROUTE *route = conn->route;
+	char key[4+255];
+	uint32_t host = htonl(conn->host);
+	
+	if (route->gen == self->topics_gen) {
+		return route;
+	}
+	
+	memcpy(key, &host, 4); // ip + event
+	memcpy(key+4, conn->event, conn->elen);
+	route->topics[0] = mined_topic_find(self, key, conn->elen+4, 0);
+	memset(key, 0, 4);     // any_ip + event
+	route->topics[1] = mined_topic_find(self, key, conn->elen+4, 0);
+	route->gen = self->topics_gen;
+	
+	return route;
+}
+
+// mark gid as defined for the client
+// returns 1 if definition should be sent, 0 if it was sent already
+// and -1 if client could not get it, so event should be sent by name
+static int mined_define_id(MINED_CONN *conn, uint32_t gid) {
+	if (gid >= MINE_PROTO_EVENT_IDS) {
+		return -1;
+	}
+	
+	if (gid >= conn->nout_ids) {
+		size_t n = gid < 64 ? 64 : gid * 2;
+		char *ids = realloc(conn->out_ids, n);
+		if (!ids) {
+			return -1;
+		}
+		memset(ids + conn->nout_ids, 0, n - conn->nout_ids);
+		conn->out_ids = ids;
+		conn->nout_ids = n;
+	}
+	
+	if (conn->out_ids[gid]) {
+		return 0;
+	}
+	
+	conn->out_ids[gid] = 1;
+	return 1;
+}
+
+// shared memory ring
+
+static int mined_shm_open(MINED *self) {
+	// readers of the previous ring keep old file
+	unlink(self->shm_path);
+	int fd = open(self->shm_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+	if (fd == -1) {
+		goto MINED_SHM_OPEN_ERROR;
+	}
+	
+	if (ftruncate(fd, MINE_SHM_HDR_SIZE + self->shm_size) == -1) {
+		close(fd);
+		goto MINED_SHM_OPEN_ERROR;
+	}
+	
+	void *map = mmap(NULL, MINE_SHM_HDR_SIZE + self->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		goto MINED_SHM_OPEN_ERROR;
+	}
+	
+	self->shm = map;
+	self->shm_ring = (char *)map + MINE_SHM_HDR_SIZE;
+	self->shm->size = self->shm_size;
+	self->shm->magic = MINE_SHM_MAGIC;
+	
+	return 1;
+	
+	MINED_SHM_OPEN_ERROR:
+		mined_warn("%s: %s", self->shm_path, strerror(errno));
+		return 0;
+}
+
+// readers are woken up once per loop iteration, not per frame
+static void mined_shm_wake(MINED *self) {
+	if (self->shm_wake) {
+		self->shm_wake = 0;
+		__atomic_add_fetch(&self->shm->futex, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &self->shm->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static void mined_shm_finish(MINED *self, MINED_CONN *conn, uint32_t state) {
+	MINE_SHM_FRAME *frame = (MINE_SHM_FRAME *)(self->shm_ring + conn->shm_pos % self->shm_size);
+	
+	__atomic_store_n(&frame->state, state, __ATOMIC_RELEASE);
+	conn->shm_active = 0;
+	self->shm_wake = 1;
+}
+
+// reserve frame for the whole message when it starts, so data of the
+// message could be copied to the ring as it comes from the publisher
+static void mined_shm_begin(MINED *self, MINED_CONN *conn) {
+	MINE_SHM_HDR *hdr = self->shm;
+	uint64_t need = (sizeof(MINE_SHM_FRAME) + conn->elen + 1 + conn->datalen + 7) & ~7ULL;
+	
+	conn->shm_active = 0;
+	if (need > hdr->size / 2) {
+		// too big for the ring, only socket subscribers will get it
+		return;
+	}
+	
+	// frames never wrap, end of the ring is skipped if frame does not fit
+	uint64_t pos = hdr->head;
+	uint64_t off = pos % hdr->size;
+	uint64_t skip = off + need > hdr->size ? hdr->size - off : 0;
+	uint64_t end = pos + skip + need;
+	
+	// tail goes forward before frames will be overwritten
+	uint64_t tail = hdr->tail;
+	while (end - tail > hdr->size) {
+		tail += ((MINE_SHM_FRAME *)(self->shm_ring + tail % hdr->size))->len;
+	}
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	if (skip) {
+		MINE_SHM_FRAME *frame = (MINE_SHM_FRAME *)(self->shm_ring + off);
+		frame->len = skip;
+		frame->state = MINE_SHM_SKIP;
+	}
+	
+	MINE_SHM_FRAME *frame = (MINE_SHM_FRAME *)(self->shm_ring + (pos + skip) % hdr->size);
+	frame->len = need;
+	frame->state = MINE_SHM_WRITING;
+	frame->host = htonl(conn->host);
+	frame->elen = conn->elen;
+	frame->datalen = conn->datalen;
+	memcpy(frame + 1, conn->event, conn->elen);
+	((char *)(frame + 1))[conn->elen] = '\0';
+	__atomic_store_n(&hdr->head, end, __ATOMIC_RELEASE);
+	
+	conn->shm_active = 1;
+	conn->shm_pos = pos + skip;
+	conn->shm_off = sizeof(MINE_SHM_FRAME) + conn->elen + 1;
+	conn->shm_left = conn->datalen;
+	if (conn->shm_left == 0) {
+		mined_shm_finish(self, conn, MINE_SHM_READY);
+	}
+}
+
+static void mined_shm_write(MINED *self, MINED_CONN *conn, const char *buf, size_t len) {
+	if (!conn->shm_active) {
+		return;
+	}
+	
+	if (self->shm->tail > conn->shm_pos) {
+		// ring went round while publisher was sending, frame is lost
+		conn->shm_active = 0;
+		return;
+	}
+	
+	memcpy(self->shm_ring + conn->shm_pos % self->shm_size + conn->shm_off, buf, len);
+	conn->shm_off += len;
+	if ((conn->shm_left -= len) == 0) {
+		mined_shm_finish(self, conn, MINE_SHM_READY);
+	}
+}
+
+// connection io
+
+// returns bytes written, 0 if socket is not ready, -1 on error
+static ssize_t mined_conn_write(MINED_CONN *conn, const void *buf, size_t len) {
+	ssize_t rv;
+	
+	if (conn->ssl) {
+		// error queue is per thread, so failure of another connection
+		// would be taken for failure of this one by SSL_get_error()
+		ERR_clear_error();
+		rv = SSL_write(conn->ssl, buf, len);
+		if (rv <= 0) {
+			int err = SSL_get_error(conn->ssl, rv);
+			return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? 0 : -1;
+		}
+		
+		return rv;
+	}
+	
+	rv = send(conn->fd, buf, len, MSG_NOSIGNAL);
+	if (rv == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+	
+	return rv;
+}
+
+// bytes queued for the connection, in memory and on the disk
+static uint64_t mined_conn_depth(MINED_CONN *conn) {
+	return conn->wlen - conn->woff + conn->spill_wr - conn->spill_rd;
+}
+
+static void mined_conn_peak(MINED_CONN *conn) {
+	uint64_t depth = mined_conn_depth(conn);
+	
+	if (depth > conn->peak) {
+		conn->peak = depth;
+	}
+}
+
+// appends data to the spill file, which is created on the first use
+static void mined_conn_spill(MINED *self, MINED_CONN *conn, const char *buf, size_t len) {
+	if (conn->spill_fd == -1) {
+		char path[PATH_MAX];
+		
+		snprintf(path, sizeof(path), "%s/mine-spill-XXXXXX", self->spill_path ? self->spill_path : P_tmpdir);
+		conn->spill_fd = mkstemp(path);
+		if (conn->spill_fd == -1) {
+			mined_warn("spill: %s: %s", path, strerror(errno));
+			mined_conn_close(self, conn);
+			return;
+		}
+		
+		// nobody else needs the file
+		unlink(path);
+	}
+	
+	while (len) {
+		ssize_t rv = pwrite(conn->spill_fd, buf, len, conn->spill_wr);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			mined_warn("spill: %s", strerror(errno));
+			mined_conn_close(self, conn);
+			return;
+		}
+		
+		buf += rv;
+		len -= rv;
+		conn->spill_wr += rv;
+		conn->spilled += rv;
+	}
+	
+	mined_conn_peak(conn);
+}
+
+// reads next part of the spill file to the empty write buffer
+// returns 0 if there is nothing to write
+static char mined_conn_unspill(MINED *self, MINED_CONN *conn) {
+	size_t len = conn->spill_wr - conn->spill_rd < MINED_RBUF_SIZE ? conn->spill_wr - conn->spill_rd : MINED_RBUF_SIZE;
+	ssize_t rv;
+	
+	if (len == 0) {
+		return 0;
+	}
+	
+	if (conn->wcap < len) {
+		char *wbuf = realloc(conn->wbuf, MINED_RBUF_SIZE);
+		if (!wbuf) {
+			mined_warn("out of memory, dropping client");
+			mined_conn_close(self, conn);
+			return 0;
+		}
+		
+		conn->wbuf = wbuf;
+		conn->wcap = MINED_RBUF_SIZE;
+	}
+	
+	do {
+		rv = pread(conn->spill_fd, conn->wbuf, len, conn->spill_rd);
+	} while (rv == -1 && errno == EINTR);
+	
+	if (rv <= 0) {
+		mined_warn("spill: %s", rv ? strerror(errno) : "unexpected end of file");
+		mined_conn_close(self, conn);
+		return 0;
+	}
+	
+	conn->wlen = rv;
+	conn->spill_rd += rv;
+	if (conn->spill_rd == conn->spill_wr) {
+		// all read, so the file could be used from the start
+		conn->spill_rd = conn->spill_wr = 0;
+		if (ftruncate(conn->spill_fd, 0) == -1) {
+			mined_warn("spill: %s", strerror(errno));
+		}
+	}
+	
+	return 1;
+}
+
+static void mined_conn_flush(MINED *self, MINED_CONN *conn) {
+	do {
+		while (conn->woff < conn->wlen) {
+			ssize_t rv = mined_conn_write(conn, conn->wbuf + conn->woff, conn->wlen - conn->woff);
+			if (rv == 0) {
+				return;
+			}
+			if (rv < 0) {
+				mined_conn_close(self, conn);
+				return;
+			}
+			
+			conn->woff += rv;
+			conn->qpos += rv;
+		}
+		
+		conn->woff = conn->wlen = 0;
+	} while (mined_conn_unspill(self, conn));
+}
+
+// message starts for the connection, key is seq of the conflated subscription
+static char mined_conn_mark(MINED *self, MINED_CONN *conn, uint64_t key) {
+	while (conn->mhead < conn->nmarks && conn->marks[conn->mhead].pos < conn->qpos) {
+		// already written, at least partially
+		conn->mhead++;
+	}
+	
+	if (conn->nmarks == conn->marks_cap && conn->mhead) {
+		memmove(conn->marks, conn->marks + conn->mhead, (conn->nmarks - conn->mhead) * sizeof(MINED_MARK));
+		conn->nmarks -= conn->mhead;
+		conn->mhead = 0;
+	}
+	
+	if (conn->nmarks == conn->marks_cap) {
+		size_t cap = conn->marks_cap ? conn->marks_cap * 2 : 16;
+		MINED_MARK *marks = realloc(conn->marks, cap * sizeof(MINED_MARK));
+		if (!marks) {
+			mined_warn("out of memory, dropping client");
+			mined_conn_close(self, conn);
+			return 0;
+		}
+		
+		conn->marks = marks;
+		conn->marks_cap = cap;
+	}
+	
+	conn->marks[conn->nmarks].pos = conn->qpos + mined_conn_depth(conn);
+	conn->marks[conn->nmarks].end = 0;
+	conn->marks[conn->nmarks].key = key;
+	conn->marks[conn->nmarks].pinned = 0;
+	conn->nmarks++;
+	
+	return 1;
+}
+
+// removes queued messages from i to n, which were not written yet, len bytes
+// from the start of the first one. Bytes before them move to their place
+static void mined_conn_cut(MINED_CONN *conn, size_t i, size_t n, uint64_t len) {
+	MINED_MARK *marks = conn->marks;
+	size_t k;
+	
+	memmove(conn->wbuf + conn->woff + len, conn->wbuf + conn->woff, marks[i].pos - conn->qpos);
+	conn->woff += len;
+	conn->qpos += len;
+	for (k=conn->mhead; k<i; k++) {
+		marks[k].pos += len;
+		if (marks[k].end) {
+			marks[k].end += len;
+		}
+	}
+	
+	memmove(marks + i, marks + n, (conn->nmarks - n) * sizeof(MINED_MARK));
+	conn->nmarks -= n - i;
+}
+
+// drops oldest messages which were not written yet, at least bytes if possible
+// the newest one is kept, because its data could still come, and pinned ones
+static void mined_conn_evict(MINED_CONN *conn, uint64_t bytes) {
+	MINED_MARK *marks = conn->marks;
+	size_t last, i, n;
+	uint64_t from;
+	
+	if (conn->nmarks == 0) {
+		return;
+	}
+	
+	// ssl could hold the record with the head of the buffer,
+	// which should be written again with the same data
+	from = conn->qpos + (conn->ssl ? MINE_SSL_RECORD_SIZE : 0);
+	last = conn->nmarks - 1;
+	for (i=conn->mhead; i<last && (marks[i].pinned || marks[i].pos < from); i++);
+	if (i >= last) {
+		return;
+	}
+	
+	for (n=i+1; n<last && !marks[n].pinned && marks[n].pos - marks[i].pos < bytes; n++);
+	
+	mined_conn_cut(conn, i, n, marks[n].pos - marks[i].pos);
+	conn->dropped += n - i;
+}
+
+// removes the previous message of the conflated subscription if it was
+// not written yet, so the new one replaces it
+static void mined_conn_conflate(MINED_CONN *conn, uint64_t key) {
+	MINED_MARK *mark;
+	size_t i;
+	
+	for (i=conn->nmarks; i>conn->mhead && conn->marks[i-1].key != key; i--);
+	if (i == conn->mhead) {
+		return;
+	}
+	
+	// it should be complete and in memory
+	mark = &conn->marks[--i];
+	if (mark->pinned || !mark->end || mark->end > conn->qpos + conn->wlen - conn->woff ||
+	    mark->pos < conn->qpos + (conn->ssl ? MINE_SSL_RECORD_SIZE : 0)) {
+		return;
+	}
+	
+	mined_conn_cut(conn, i, i+1, mark->end - mark->pos);
+	conn->conflated++;
+}
+
+// decides if the message of the size could be queued for the connection according
+// to out_queue_policy, message bigger than the limit is accepted by empty queue
+// key is seq of the conflated subscription or 0
+static char mined_admit(MINED *self, MINED_CONN *conn, uint64_t size, uint64_t key) {
+	uint64_t depth;
+	
+	if (key) {
+		mined_conn_conflate(conn, key);
+	}
+	
+	depth = mined_conn_depth(conn);
+	
+	if (self->out_limit && depth && depth + size > self->out_limit) {
+		switch (self->out_policy) {
+			case MINED_POLICY_DISCONNECT:
+				DEBUG("output queue limit exceeded for %d: %llu\n", conn->fd, (unsigned long long)depth);
+				mined_conn_close(self, conn);
+				return 0;
+			case MINED_POLICY_DROP_OLDEST:
+				mined_conn_evict(conn, depth + size - self->out_limit);
+				if (mined_conn_depth(conn) + size <= self->out_limit) {
+					break;
+				}
+				// fall through
+			case MINED_POLICY_DROP_NEWEST:
+				conn->dropped++;
+				return 0;
+		}
+	}
+	
+	if (self->out_policy == MINED_POLICY_DROP_OLDEST || key) {
+		return mined_conn_mark(self, conn, key);
+	}
+	
+	return 1;
+}
+
+static void mined_conn_send(MINED *self, MINED_CONN *conn, const void *buf, size_t len) {
+	if (conn->dead || len == 0) {
+		return;
+	}
+	
+	if (conn->wlen == 0 && conn->spill_rd == conn->spill_wr) {
+		// nothing queued, try to write directly
+		ssize_t rv = mined_conn_write(conn, buf, len);
+		if (rv < 0) {
+			mined_conn_close(self, conn);
+			return;
+		}
+		
+		conn->qpos += rv;
+		buf = (const char *)buf + rv;
+		len -= rv;
+		if (len == 0) {
+			return;
+		}
+	}
+	
+	if (self->out_policy == MINED_POLICY_SPILL && self->out_limit &&
+	    (conn->spill_rd != conn->spill_wr || conn->wlen - conn->woff + len > self->out_limit)) {
+		// queued data is always older than spilled one
+		mined_conn_spill(self, conn, buf, len);
+		return;
+	}
+	
+	if (conn->wlen + len > conn->wcap) {
+		size_t cap = conn->wcap ? conn->wcap : 4096;
+		char *wbuf;
+		
+		while (cap < conn->wlen + len) {
+			cap *= 2;
+		}
+		
+		wbuf = realloc(conn->wbuf, cap);
+		if (!wbuf) {
+			mined_warn("out of memory, dropping client");
+			mined_conn_close(self, conn);
+			return;
+		}
+		
+		conn->wbuf = wbuf;
+		conn->wcap = cap;
+	}
+	
+	memcpy(conn->wbuf + conn->wlen, buf, len);
+	conn->wlen += len;
+	mined_conn_peak(conn);
+}
+
+static void mined_conn_close(MINED *self, MINED_CONN *conn) {
+	if (conn->dead) {
+		return;
+	}
+	
+	DEBUG("mined_conn_close(%d)\n", conn->fd);
+	conn->dead = 1;
+	epoll_ctl(self->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	
+	// connection could be still referenced in the current event batch
+	// so it will be freed later
+	conn->next_dead = self->dead;
+	self->dead = conn;
+}
+
+// journal
+
+// record in the segment is seq, host, state, elen and datalen followed by event
+// and data. Index of the segment is mmaped array with offset+1 of each record,
+// so zero means it was not indexed yet
+
+static uint64_t mined_ms() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mined_journal_file(MINED *self, uint64_t first, const char *ext, char *path) {
+	snprintf(path, PATH_MAX, "%s/%020llu.%s", self->jpath, (unsigned long long)first, ext);
+}
+
+static char mined_journal_pwrite(int fd, const void *buf, size_t len, uint64_t off) {
+	while (len > 0) {
+		ssize_t rv = pwrite(fd, buf, len, off);
+		if (rv == -1 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			mined_warn("journal: %s", rv == -1 ? strerror(errno) : "short write");
+			return 0;
+		}
+		
+		buf = (const char *)buf + rv;
+		len -= rv;
+		off += rv;
+	}
+	
+	return 1;
+}
+
+// maps index of the segment, new one is created if create is set
+static uint64_t *mined_journal_index(MINED *self, uint64_t first, char create) {
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t *idx;
+	int fd;
+	
+	mined_journal_file(self, first, "idx", path);
+	fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0600);
+	if (fd == -1) {
+		return NULL;
+	}
+	
+	if (create ? ftruncate(fd, MINED_JOURNAL_INDEX * sizeof(uint64_t)) == -1 :
+	             fstat(fd, &st) == -1 || st.st_size < MINED_JOURNAL_INDEX * (off_t)sizeof(uint64_t)) {
+		close(fd);
+		return NULL;
+	}
+	
+	idx = mmap(NULL, MINED_JOURNAL_INDEX * sizeof(uint64_t), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	return idx == MAP_FAILED ? NULL : idx;
+}
+
+static void mined_journal_flush(MINED *self) {
+	if (self->jbuf_len) {
+		mined_journal_pwrite(self->jfd, self->jbuf, self->jbuf_len, self->jbuf_off);
+		self->jbuf_off += self->jbuf_len;
+		self->jbuf_len = 0;
+		self->jdirty = 1;
+	}
+}
+
+// data goes first, so indexed records are on the disk
+static void mined_journal_sync(MINED *self) {
+	if (self->jdirty) {
+		fdatasync(self->jfd);
+		msync(self->jidx, MINED_JOURNAL_INDEX * sizeof(uint64_t), MS_SYNC);
+		self->jdirty = 0;
+	}
+	
+	self->jsynced = mined_ms();
+}
+
+// closes the current segment and starts the new one from record jnext
+static char mined_journal_roll(MINED *self) {
+	char path[PATH_MAX];
+	
+	if (self->jfd != -1) {
+		mined_journal_flush(self);
+		mined_journal_sync(self);
+		munmap(self->jidx, MINED_JOURNAL_INDEX * sizeof(uint64_t));
+		close(self->jfd);
+		self->jfd = -1;
+	}
+	
+	if (self->njsegs == self->jsegs_cap) {
+		size_t n = self->jsegs_cap ? self->jsegs_cap * 2 : 16;
+		uint64_t *grown = realloc(self->jsegs, n * sizeof(uint64_t));
+		if (!grown) {
+			mined_warn("journal: out of memory");
+			return 0;
+		}
+		self->jsegs = grown;
+		self->jsegs_cap = n;
+	}
+	
+	mined_journal_file(self, self->jnext, "log", path);
+	self->jfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (self->jfd == -1 || !(self->jidx = mined_journal_index(self, self->jnext, 1))) {
+		mined_warn("journal %s: %s", path, strerror(errno));
+		if (self->jfd != -1) {
+			close(self->jfd);
+			self->jfd = -1;
+		}
+		return 0;
+	}
+	
+	self->jsegs[self->njsegs++] = self->jfirst = self->jnext;
+	self->jsize = self->jbuf_off = self->jbuf_len = 0;
+	
+	// readers keep removed segments open while they need them
+	while (self->jseg_max && self->njsegs > self->jseg_max) {
+		mined_journal_file(self, self->jsegs[0], "log", path);
+		unlink(path);
+		mined_journal_file(self, self->jsegs[0], "idx", path);
+		unlink(path);
+		memmove(self->jsegs, self->jsegs+1, --self->njsegs * sizeof(uint64_t));
+	}
+	
+	return 1;
+}
+
+static int mined_journal_cmp(const void *a, const void *b) {
+	return *(const uint64_t *)a < *(const uint64_t *)b ? -1 : *(const uint64_t *)a > *(const uint64_t *)b;
+}
+
+// finds segments of the previous runs and starts the new one after them
+static int mined_journal_open(MINED *self) {
+	struct dirent *de;
+	DIR *dir;
+	
+	if (mkdir(self->jpath, 0700) == -1 && errno != EEXIST) {
+		mined_warn("journal %s: %s", self->jpath, strerror(errno));
+		return 0;
+	}
+	
+	if (!(dir = opendir(self->jpath))) {
+		mined_warn("journal %s: %s", self->jpath, strerror(errno));
+		return 0;
+	}
+	
+	while ((de = readdir(dir))) {
+		unsigned long long first;
+		int n = 0;
+		
+		if (sscanf(de->d_name, "%20llu.log%n", &first, &n) != 1 || n != 24 || de->d_name[n]) {
+			continue;
+		}
+		
+		if (self->njsegs == self->jsegs_cap) {
+			size_t cap = self->jsegs_cap ? self->jsegs_cap * 2 : 16;
+			uint64_t *grown = realloc(self->jsegs, cap * sizeof(uint64_t));
+			if (!grown) {
+				closedir(dir);
+				mined_warn("journal: out of memory");
+				return 0;
+			}
+			self->jsegs = grown;
+			self->jsegs_cap = cap;
+		}
+		self->jsegs[self->njsegs++] = first;
+	}
+	closedir(dir);
+	qsort(self->jsegs, self->njsegs, sizeof(uint64_t), mined_journal_cmp);
+	
+	self->jnext = 1;
+	if (self->njsegs) {
+		uint64_t last = self->jsegs[self->njsegs-1];
+		uint64_t *idx = mined_journal_index(self, last, 0);
+		size_t lo = 0, hi = MINED_JOURNAL_INDEX;
+		
+		// records are indexed in order, so indexed ones are found by binary search
+		while (idx && lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (idx[mid]) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		
+		if (idx) {
+			munmap(idx, MINED_JOURNAL_INDEX * sizeof(uint64_t));
+		}
+		
+		self->jnext = last + lo;
+		if (lo == 0) {
+			// empty segment is created again
+			self->njsegs--;
+		}
+	}
+	
+	self->jstart = self->jnext;
+	self->jbuf = malloc(MINED_JOURNAL_BUF);
+	if (!self->jbuf) {
+		mined_warn("journal: out of memory");
+		return 0;
+	}
+	
+	return mined_journal_roll(self);
+}
+
+// reserves space for the whole record at the end of the current segment
+// small records are collected in jbuf, bigger ones are written directly
+static uint64_t mined_journal_reserve(MINED *self, uint64_t total) {
+	uint64_t off = self->jsize;
+	
+	self->jsize += total;
+	if (self->jsize - self->jbuf_off > MINED_JOURNAL_BUF) {
+		mined_journal_flush(self);
+		if (total > MINED_JOURNAL_BUF) {
+			self->jbuf_off = self->jsize;
+		}
+	}
+	
+	if (self->jbuf_off <= off) {
+		memset(self->jbuf + self->jbuf_len, 0, self->jsize - self->jbuf_off - self->jbuf_len);
+		self->jbuf_len = self->jsize - self->jbuf_off;
+	}
+	
+	return off;
+}
+
+// writes part of the current record of the publisher
+static void mined_journal_write(MINED *self, MINED_CONN *conn, uint64_t off, const void *buf, size_t len) {
+	if (conn->jseg == self->jfirst && self->jfd != -1) {
+		if (off >= self->jbuf_off) {
+			memcpy(self->jbuf + (off - self->jbuf_off), buf, len);
+		}
+		else {
+			mined_journal_pwrite(self->jfd, buf, len, off);
+			self->jdirty = 1;
+		}
+		return;
+	}
+	
+	// segment was closed while data was coming
+	if (conn->jwfd == -1) {
+		char path[PATH_MAX];
+		
+		mined_journal_file(self, conn->jseg, "log", path);
+		conn->jwfd = open(path, O_WRONLY);
+	}
+	if (conn->jwfd != -1) {
+		mined_journal_pwrite(conn->jwfd, buf, len, off);
+	}
+}
+
+// the record is complete or dropped
+static void mined_journal_finish(MINED *self, MINED_CONN *conn, char state) {
+	mined_journal_write(self, conn, conn->jrec + 12, &state, 1);
+	
+	if (conn->jwfd != -1) {
+		fdatasync(conn->jwfd);
+		close(conn->jwfd);
+		conn->jwfd = -1;
+	}
+	conn->jseq = 0;
+}
+
+// writes the message of the publisher to the journal as its data comes
+// space for the whole record is reserved on the first chunk, so records
+// of different publishers do not mix
+static void mined_journal_append(MINED *self, MINED_CONN *conn, const char *buf, size_t len, char first) {
+	if (first) {
+		uint64_t total = MINED_JOURNAL_HDR + conn->elen + conn->datalen;
+		uint64_t datalen = conn->datalen;
+		char hdr[MINED_JOURNAL_HDR+255];
+		
+		conn->jseq = conn->msg_jseq = 0;
+		if (self->jfd == -1) {
+			return;
+		}
+		
+		if ((self->jsize && self->jsize + total > self->jseg_size) || self->jnext - self->jfirst == MINED_JOURNAL_INDEX) {
+			if (!mined_journal_roll(self)) {
+				return;
+			}
+		}
+		
+		memcpy(hdr, &self->jnext, 8);
+		memcpy(hdr+8, &conn->host, 4);
+		hdr[12] = (uint64_t)conn->datalen == len ? MINED_RECORD_COMPLETE : MINED_RECORD_PENDING;
+		hdr[13] = conn->elen;
+		memcpy(hdr+14, &datalen, 8);
+		memcpy(hdr+MINED_JOURNAL_HDR, conn->event, conn->elen);
+		
+		conn->jseq  = conn->msg_jseq = self->jnext;
+		conn->jseg  = self->jfirst;
+		conn->jrec  = mined_journal_reserve(self, total);
+		conn->jpos  = conn->jrec + MINED_JOURNAL_HDR + conn->elen;
+		conn->jleft = conn->datalen;
+		mined_journal_write(self, conn, conn->jrec, hdr, MINED_JOURNAL_HDR + conn->elen);
+		self->jidx[self->jnext++ - self->jfirst] = conn->jrec + 1;
+	}
+	
+	if (!conn->jseq) {
+		return;
+	}
+	
+	if (len) {
+		mined_journal_write(self, conn, conn->jpos, buf, len);
+		conn->jpos += len;
+		conn->jleft -= len;
+	}
+	
+	if (conn->jleft == 0) {
+		if (first) {
+			// state was written with the header
+			conn->jseq = 0;
+		}
+		else {
+			mined_journal_finish(self, conn, MINED_RECORD_COMPLETE);
+		}
+	}
+}
+
+// finds subscriptions of the connection which catch up and want the record
+// they are moved after it if mark is set
+static char mined_journal_match(MINED_CONN *conn, uint64_t seq, uint32_t host, const char *event, unsigned char elen, char mark) {
+	char found = 0;
+	size_t ci;
+	
+	for (ci=0; ci<conn->nsubs; ci++) {
+		MINED_TOPIC *topic = conn->subs[ci].topic;
+		MINED_SUBSCRIBER *sub;
+		uint32_t ip;
+		
+		if (conn->subs[ci].group) {
+			continue;
+		}
+		
+		sub = &topic->subs[conn->subs[ci].idx];
+		if (!sub->from || sub->from > seq || topic->klen != (size_t)elen + 4 || memcmp(topic->key+4, event, elen) != 0) {
+			continue;
+		}
+		
+		memcpy(&ip, topic->key, 4);
+		if (ip && ntohl(ip) != host) {
+			continue;
+		}
+		
+		found = 1;
+		if (mark) {
+			sub->from = seq + 1;
+		}
+	}
+	
+	return found;
+}
+
+static void mined_journal_unseek(MINED_CONN *conn) {
+	if (conn->jridx) {
+		munmap(conn->jridx, MINED_JOURNAL_INDEX * sizeof(uint64_t));
+		conn->jridx = NULL;
+	}
+	if (conn->jrfd != -1) {
+		close(conn->jrfd);
+		conn->jrfd = -1;
+	}
+}
+
+// opens segment with the record for reading
+static char mined_journal_seek(MINED *self, MINED_CONN *conn, uint64_t seq) {
+	char path[PATH_MAX];
+	size_t lo = 0, hi = self->njsegs;
+	
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (self->jsegs[mid] <= seq) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	
+	if (conn->jridx && conn->jrfirst == self->jsegs[lo]) {
+		return 1;
+	}
+	
+	mined_journal_unseek(conn);
+	mined_journal_file(self, self->jsegs[lo], "log", path);
+	if ((conn->jrfd = open(path, O_RDONLY)) == -1 || !(conn->jridx = mined_journal_index(self, self->jsegs[lo], 0))) {
+		mined_warn("journal %s: %s", path, strerror(errno));
+		mined_journal_unseek(conn);
+		return 0;
+	}
+	conn->jrfirst = self->jsegs[lo];
+	
+	return 1;
+}
+
+// connection caught up, so new messages come to it as usual
+static void mined_journal_live(MINED *self, MINED_CONN *conn) {
+	size_t ci;
+	
+	for (ci=0; ci<conn->nsubs; ci++) {
+		if (!conn->subs[ci].group) {
+			conn->subs[ci].topic->subs[conn->subs[ci].idx].from = 0;
+		}
+	}
+	
+	mined_journal_unseek(conn);
+	conn->catching = 0;
+	self->ncatching--;
+	
+	// nothing will pump the tail of the replay anymore
+	mined_conn_flush(self, conn);
+}
+
+// sends journaled messages to the connection which catches up while its queue
+// is short, stops on pending record until its data will come
+static void mined_journal_pump(MINED *self, MINED_CONN *conn) {
+	int budget = MINED_JOURNAL_SCAN;
+	
+	if (self->jfd != -1) {
+		mined_journal_flush(self);
+	}
+	
+	while (!conn->dead) {
+		char hdr[MINED_JOURNAL_HDR+255], frame[1+10+2+255+10];
+		uint64_t off, datalen;
+		uint32_t host;
+		unsigned char elen;
+		size_t flen;
+		ssize_t rv;
+		
+		if (mined_conn_depth(conn) >= MINED_JOURNAL_BUF) {
+			// ssl writes a record at a time, so the socket may be not full yet
+			mined_conn_flush(self, conn);
+			if (conn->dead || mined_conn_depth(conn) >= MINED_JOURNAL_BUF) {
+				return;
+			}
+		}
+		
+		if (conn->jcur >= self->jnext || !self->njsegs) {
+			mined_journal_live(self, conn);
+			return;
+		}
+		
+		if (budget-- == 0) {
+			self->jbusy = 1;
+			return;
+		}
+		
+		if (conn->jcur < self->jsegs[0]) {
+			// removed already
+			conn->jcur = self->jsegs[0];
+		}
+		
+		if (!mined_journal_seek(self, conn, conn->jcur)) {
+			mined_journal_live(self, conn);
+			return;
+		}
+		
+		off = conn->jridx[conn->jcur - conn->jrfirst];
+		rv = off ? pread(conn->jrfd, hdr, sizeof(hdr), off-1) : -1;
+		
+		elen = rv < MINED_JOURNAL_HDR ? 0 : hdr[13];
+		if (rv < MINED_JOURNAL_HDR + elen) {
+			if (conn->jcur >= self->jstart) {
+				// header is still coming
+				return;
+			}
+			
+			// lost by the previous run
+			conn->jcur++;
+			continue;
+		}
+		
+		// header is written on reservation, so messages of other events
+		// are skipped without waiting for their data
+		memcpy(&host, hdr+8, 4);
+		memcpy(&datalen, hdr+14, 8);
+		if (!mined_journal_match(conn, conn->jcur, host, hdr+MINED_JOURNAL_HDR, elen, 0)) {
+			conn->jcur++;
+			continue;
+		}
+		
+		if (hdr[12] == MINED_RECORD_PENDING && conn->jcur >= self->jstart) {
+			// data is still coming
+			return;
+		}
+		
+		if (hdr[12] != MINED_RECORD_COMPLETE) {
+			// dropped or lost by the previous run
+			conn->jcur++;
+			continue;
+		}
+		
+		frame[0] = MINE_PROTO_EVENT_SEQ;
+		flen = 1 + _mine_varint_put(frame+1, conn->jcur);
+		frame[flen+1] = elen;
+		memcpy(frame+flen+2, hdr+MINED_JOURNAL_HDR, elen);
+		if (conn->caps & MINE_CAP_COMPACT) {
+			frame[flen] = MINE_PROTO_EVENT_DATA_SND;
+			flen += 2 + elen + _mine_varint_put(frame+flen+2+elen, datalen);
+		}
+		else {
+			frame[flen] = MINE_PROTO_EVENT_SND;
+			frame[flen+2+elen] = MINE_PROTO_DATA_SND;
+			memcpy(frame+flen+3+elen, &datalen, 8);
+			flen += 3 + elen + 8;
+		}
+		
+		if (self->out_limit && mined_conn_depth(conn) && mined_conn_depth(conn) + flen + datalen > self->out_limit) {
+			// after the drain
+			return;
+		}
+		
+		if (mined_admit(self, conn, flen + datalen, 0)) {
+			char data[65536];
+			
+			mined_conn_send(self, conn, frame, flen);
+			for (off += MINED_JOURNAL_HDR + elen - 1; datalen > 0 && !conn->dead; off += rv, datalen -= rv) {
+				rv = pread(conn->jrfd, data, datalen < sizeof(data) ? datalen : sizeof(data), off);
+				if (rv <= 0) {
+					mined_warn("journal: %s", rv == -1 ? strerror(errno) : "record is truncated");
+					mined_conn_close(self, conn);
+					return;
+				}
+				mined_conn_send(self, conn, data, rv);
+			}
+		}
+		
+		mined_journal_match(conn, conn->jcur++, host, hdr+MINED_JOURNAL_HDR, elen, 1);
+	}
+}
+
+// subscription with key starts from journal record seq, 0 is the oldest one
+static void mined_journal_from(MINED *self, MINED_CONN *conn, const char *key, size_t klen, uint64_t seq) {
+	size_t ci;
+	
+	conn->want_seq = 1;
+	if (!self->jpath || seq >= self->jnext) {
+		return;
+	}
+	
+	for (ci=0; ci<conn->nsubs; ci++) {
+		MINED_TOPIC *topic = conn->subs[ci].topic;
+		
+		if (!conn->subs[ci].group && topic->klen == klen && memcmp(topic->key, key, klen) == 0) {
+			break;
+		}
+	}
+	if (ci == conn->nsubs) {
+		return;
+	}
+	
+	if (!seq) {
+		seq = 1;
+	}
+	conn->subs[ci].topic->subs[conn->subs[ci].idx].from = seq;
+	
+	// records already sent to other subscriptions are skipped by them
+	if (!conn->catching || seq < conn->jcur) {
+		conn->jcur = seq;
+	}
+	if (!conn->catching) {
+		conn->catching = 1;
+		self->ncatching++;
+	}
+	
+	mined_journal_pump(self, conn);
+}
+
+// called after each batch of events, returns timeout for the next wait
+static int mined_journal_tick(MINED *self) {
+	MINED_CONN *conn;
+	uint64_t now;
+	
+	if (!self->jpath) {
+		return -1;
+	}
+	
+	if (self->jfd != -1) {
+		mined_journal_flush(self);
+	}
+	
+	self->jbusy = 0;
+	for (conn = self->conns; self->ncatching && conn; conn = conn->next) {
+		if (conn->catching && !conn->dead) {
+			mined_journal_pump(self, conn);
+		}
+	}
+	
+	now = mined_ms();
+	if (self->jfd != -1 && self->jdirty && now - self->jsynced >= self->jsync) {
+		mined_journal_sync(self);
+	}
+	
+	if (self->jbusy) {
+		return 0;
+	}
+	
+	return self->jdirty ? (int)(self->jsync - (now - self->jsynced)) : -1;
+}
+
+static void mined_conn_free(MINED *self, MINED_CONN *conn) {
+	mined_unsubscribe_all(self, conn);
+	
+	if (conn->shm_active && self->shm->tail <= conn->shm_pos) {
+		// readers should not wait for the rest of the message
+		mined_shm_finish(self, conn, MINE_SHM_DROPPED);
+	}
+	
+	if (conn->ssl) {
+		SSL_free(conn->ssl);
+	}
+	
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	}
+	else {
+		self->conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	
+	if (conn->spill_fd != -1) {
+		close(conn->spill_fd);
+	}
+	
+	if (conn->jseq) {
+		// the rest of the data will never come
+		mined_journal_finish(self, conn, MINED_RECORD_DROPPED);
+	}
+	if (conn->catching) {
+		self->ncatching--;
+	}
+	mined_journal_unseek(conn);
+	
+	close(conn->fd);
+	free(conn->wbuf);
+	free(conn->marks);
+	free(conn->routes);
+	free(conn->out_ids);
+	free(conn->picks);
+	free(conn->lv);
+	free(conn);
+}
+
+// last values
+
+static MINED_VALUE *mined_value_find(MINED_EVENT *ev, uint32_t host) {
+	MINED_VALUE *v;
+	
+	for (v = ev->values; v && v->host != host; v = v->next);
+	return v;
+}
+
+static void mined_value_del(MINED *self, MINED_VALUE *v) {
+	MINED_VALUE **p;
+	
+	if (!v) {
+		return;
+	}
+	
+	for (p = &v->ev->values; *p != v; p = &(*p)->next);
+	*p = v->next;
+	
+	if (v->lru_prev) {
+		v->lru_prev->lru_next = v->lru_next;
+	}
+	else {
+		self->lv_head = v->lru_next;
+	}
+	if (v->lru_next) {
+		v->lru_next->lru_prev = v->lru_prev;
+	}
+	else {
+		self->lv_tail = v->lru_prev;
+	}
+	
+	self->lv_bytes -= v->len;
+	self->nvalues--;
+	free(v);
+}
+
+// keeps the last complete message of the event, which last value is cached,
+// to replay it to new subscribers. Message is collected while its data comes
+static void mined_remember(MINED *self, MINED_CONN *conn, const char *buf, size_t len, char first) {
+	MINED_VALUE *v;
+	
+	if (first) {
+		MINED_EVENT *ev = conn->route->ev;
+		
+		free(conn->lv);
+		conn->lv = NULL;
+		
+		if (!ev) {
+			ev = mined_event_find(self, conn->event, conn->elen, mined_hash(conn->event, conn->elen));
+		}
+		if (!ev || !ev->last_value) {
+			return;
+		}
+		
+		if ((uint64_t)conn->datalen > self->lv_size) {
+			// cached value is not the last one anymore
+			mined_value_del(self, mined_value_find(ev, conn->host));
+			return;
+		}
+		
+		conn->lv = malloc(sizeof(MINED_VALUE) + conn->datalen);
+		if (!conn->lv) {
+			mined_value_del(self, mined_value_find(ev, conn->host));
+			return;
+		}
+		conn->lv->ev = ev;
+		conn->lv->host = conn->host;
+		conn->lv->len = 0;
+	}
+	
+	if (!(v = conn->lv)) {
+		return;
+	}
+	
+	if (len) {
+		memcpy(v->data + v->len, buf, len);
+		v->len += len;
+	}
+	if ((uint64_t)conn->datalen > len) {
+		// more data will come
+		return;
+	}
+	
+	conn->lv = NULL;
+	mined_value_del(self, mined_value_find(v->ev, v->host));
+	v->next = v->ev->values;
+	v->ev->values = v;
+	v->lru_next = NULL;
+	v->lru_prev = self->lv_tail;
+	if (self->lv_tail) {
+		self->lv_tail->lru_next = v;
+	}
+	else {
+		self->lv_head = v;
+	}
+	self->lv_tail = v;
+	self->lv_bytes += v->len;
+	self->nvalues++;
+	
+	// least recently updated values are dropped first
+	while (self->lv_bytes > self->lv_limit) {
+		mined_value_del(self, self->lv_head);
+	}
+}
+
+// sends cached last values of the event to the subscriber, key is ip + event
+static void mined_replay(MINED *self, MINED_CONN *conn, const char *key, unsigned char elen) {
+	MINED_EVENT *ev = mined_event_find(self, key+4, elen, mined_hash(key+4, elen));
+	MINED_VALUE *v;
+	uint32_t host;
+	
+	if (!ev) {
+		return;
+	}
+	
+	memcpy(&host, key, 4);
+	host = ntohl(host);
+	
+	for (v = ev->values; v && !conn->dead; v = v->next) {
+		char hdr[1+1+255+1+8];
+		size_t hlen;
+		
+		if (host && v->host != host) {
+			continue;
+		}
+		
+		hdr[1] = elen;
+		memcpy(hdr+2, key+4, elen);
+		if (conn->caps & MINE_CAP_COMPACT) {
+			hdr[0] = MINE_PROTO_EVENT_DATA_SND;
+			hlen = 2 + elen + _mine_varint_put(hdr+2+elen, v->len);
+		}
+		else {
+			uint64_t datalen = v->len;
+			
+			hdr[0] = MINE_PROTO_EVENT_SND;
+			hdr[2+elen] = MINE_PROTO_DATA_SND;
+			memcpy(hdr+3+elen, &datalen, 8);
+			hlen = 3 + elen + 8;
+		}
+		
+		if (mined_admit(self, conn, hlen + v->len, 0)) {
+			mined_conn_send(self, conn, hdr, hlen);
+			mined_conn_send(self, conn, v->data, v->len);
+		}
+	}
+}
+
+// protocol
+
+// headers of the current message of the publisher in all formats,
+// each one is built once and shared by subscribers which need it
+typedef struct {
+	char hdr[1+1+255+1+8];
+	char chdr[1+1+255+10];
+	char ihdr[1+3+10];
+	char dhdr[1+3+1+255];
+	size_t hlen, chlen, ilen, dlen;
+} MINED_FRAMES;
+
+static void mined_resend_to(MINED *self, MINED_CONN *conn, MINED_CONN *w_conn, MINED_ROUTE *route,
+                            MINED_FRAMES *f, const char *buf, size_t len, char first) {
+	int def = -1;
+	
+	if (first && conn->msg_jseq && w_conn->want_seq) {
+		char seq[11];
+		
+		seq[0] = MINE_PROTO_EVENT_SEQ;
+		mined_conn_send(self, w_conn, seq, 1 + _mine_varint_put(seq+1, conn->msg_jseq));
+	}
+	
+	if (first && w_conn->caps & MINE_CAP_EVENT_ID) {
+		if (!route->ev) {
+			// published by name, so intern it now
+			route->ev = mined_event_intern(self, conn->event, conn->elen);
+		}
+		if (route->ev) {
+			def = mined_define_id(w_conn, route->ev->gid);
+		}
+	}
+	
+	if (def != -1) {
+		if (!f->ilen) {
+			f->ihdr[0] = MINE_PROTO_EVENT_ID_DATA_SND;
+			f->ilen = 1 + _mine_varint_put(f->ihdr+1, route->ev->gid);
+			f->dlen = f->ilen;
+			f->ilen += _mine_varint_put(f->ihdr+f->ilen, conn->datalen);
+			
+			f->dhdr[0] = MINE_PROTO_EVENT_DEF;
+			memcpy(f->dhdr+1, f->ihdr+1, f->dlen-1);
+			f->dhdr[f->dlen] = conn->elen;
+			memcpy(f->dhdr+f->dlen+1, conn->event, conn->elen);
+			f->dlen += 1 + conn->elen;
+		}
+		
+		if (def) {
+			if (w_conn->nmarks > w_conn->mhead) {
+				// client should get the definition, so the message is never dropped
+				w_conn->marks[w_conn->nmarks-1].pinned = 1;
+			}
+			mined_conn_send(self, w_conn, f->dhdr, f->dlen);
+		}
+		mined_conn_send(self, w_conn, f->ihdr, f->ilen);
+	}
+	else if (f->chlen && w_conn->caps & MINE_CAP_COMPACT) {
+		mined_conn_send(self, w_conn, f->chdr, f->chlen);
+	}
+	else if (f->hlen) {
+		mined_conn_send(self, w_conn, f->hdr, f->hlen);
+	}
+	
+	mined_conn_send(self, w_conn, buf, len);
+}
+
+// member of the queue group which gets the current message of the publisher
+// it is chosen on the first chunk and remembered for the rest of the data
+static MINED_CONN *mined_group_pick(MINED_CONN *conn, MINED_GROUP *group, char first) {
+	MINED_PICK *pick;
+	size_t n = group->nsubs, best = n, min = SIZE_MAX, start, i;
+	
+	if (!first) {
+		for (i=0; i<conn->npicks; i++) {
+			pick = &conn->picks[i];
+			if (pick->group != group->id) {
+				continue;
+			}
+			
+			if (pick->idx < n && group->subs[pick->idx].seq == pick->seq) {
+				return group->subs[pick->idx].conn;
+			}
+			for (pick->idx=0; pick->idx<n; pick->idx++) {
+				if (group->subs[pick->idx].seq == pick->seq) {
+					return group->subs[pick->idx].conn;
+				}
+			}
+			// member left, the rest of the message is lost for the group
+			break;
+		}
+		
+		// or group appeared in the middle of the data
+		return NULL;
+	}
+	
+	if (n == 0) {
+		return NULL;
+	}
+	
+	// sticky group keeps publisher on the same member while members
+	// are the same, otherwise the member with shortest output queue
+	// is chosen, starting from the next one to distribute equally loaded
+	start = group->sticky ? mined_hash((char *)&conn->id, sizeof(conn->id)) % n : group->rr++ % n;
+	for (i=0; i<n; i++) {
+		size_t j = (start + i) % n;
+		MINED_CONN *w_conn = group->subs[j].conn;
+		size_t depth;
+		
+		if (w_conn == conn || w_conn->dead) {
+			continue;
+		}
+		
+		depth = mined_conn_depth(w_conn);
+		if (group->sticky || depth == 0) {
+			best = j;
+			break;
+		}
+		if (depth < min) {
+			min = depth;
+			best = j;
+		}
+	}
+	
+	if (best == n) {
+		return NULL;
+	}
+	
+	if (conn->npicks == conn->picks_cap) {
+		size_t cap = conn->picks_cap ? conn->picks_cap * 2 : 4;
+		MINED_PICK *picks = realloc(conn->picks, cap * sizeof(MINED_PICK));
+		if (!picks) {
+			// could not remember, so the rest of the data will be lost
+			return NULL;
+		}
+		conn->picks = picks;
+		conn->picks_cap = cap;
+	}
+	
+	pick = &conn->picks[conn->npicks++];
+	pick->group = group->id;
+	pick->seq = group->subs[best].seq;
+	pick->idx = best;
+	
+	return group->subs[best].conn;
+}
+
+static void mined_resend_event(MINED *self, MINED_CONN *conn, const char *buf, size_t len, char first) {
+	MINED_ROUTE *route;
+	MINED_FRAMES f;
+	int k;
+	size_t i;
+	
+	if (self->jpath) {
+		mined_journal_append(self, conn, buf, len, first);
+	}
+	
+	if (self->lv_events) {
+		mined_remember(self, conn, buf, len, first);
+	}
+	
+	if (self->shm) {
+		// local readers get it from the ring, written once for all of them
+		if (first) {
+			mined_shm_begin(self, conn);
+		}
+		mined_shm_write(self, conn, buf, len);
+	}
+	
+	f.hlen = f.chlen = f.ilen = f.dlen = 0;
+	if (first) {
+		f.hlen = 1 + 1 + conn->elen + 1 + 8;
+		f.hdr[0] = MINE_PROTO_EVENT_SND;
+		f.hdr[1] = conn->elen;
+		memcpy(f.hdr+2, conn->event, conn->elen);
+		f.hdr[2+conn->elen] = MINE_PROTO_DATA_SND;
+		memcpy(f.hdr+3+conn->elen, &conn->datalen, 8);
+		
+		// the same for subscribers which understand compact frame
+		f.chdr[0] = MINE_PROTO_EVENT_DATA_SND;
+		memcpy(f.chdr+1, f.hdr+1, 1+conn->elen);
+		f.chlen = 2 + conn->elen + _mine_varint_put(f.chdr+2+conn->elen, conn->datalen);
+		
+		// queue group members are chosen again for each message
+		conn->npicks = 0;
+	}
+	
+	route = mined_route(self, conn);
+	for (k=0; k<2; k++) {
+		MINED_TOPIC *topic = route->topics[k];
+		MINED_GROUP *group;
+		
+		if (!topic) {
+			continue;
+		}
+		
+		for (i=0; i<topic->nsubs; i++) {
+			MINED_CONN *w_conn = topic->subs[i].conn;
+			
+			// subscribers registered in the middle of data
+			// should wait for the next event
+			if (w_conn == conn || w_conn->dead || topic->subs[i].seq > conn->msg_seq) {
+				continue;
+			}
+			
+			// whole message is accepted or not by the queue of the subscriber
+			// subscriber which catches up will read it from the journal
+			if (first) {
+				uint64_t key = topic->subs[i].conflate ? topic->subs[i].seq : 0;
+				
+				if ((topic->subs[i].from && conn->msg_jseq) || !mined_admit(self, w_conn, f.hlen + conn->datalen, key)) {
+					topic->subs[i].skip = conn->msg_seq;
+					continue;
+				}
+			}
+			else if (topic->subs[i].skip == conn->msg_seq) {
+				continue;
+			}
+			
+			mined_resend_to(self, conn, w_conn, route, &f, buf, len, first);
+			
+			if (first && topic->subs[i].conflate && !w_conn->dead) {
+				// the rest of the data will follow, so the end is known now
+				w_conn->marks[w_conn->nmarks-1].end = w_conn->qpos + mined_conn_depth(w_conn) + conn->datalen - len;
+			}
+		}
+		
+		for (group = topic->groups; group; group = group->next) {
+			MINED_CONN *w_conn = mined_group_pick(conn, group, first);
+			
+			if (w_conn && first && !mined_admit(self, w_conn, f.hlen + conn->datalen, 0)) {
+				// nothing for the group, so the rest of the data too
+				conn->npicks--;
+				continue;
+			}
+			if (w_conn) {
+				mined_resend_to(self, conn, w_conn, route, &f, buf, len, first);
+			}
+		}
+	}
+	
+	// record of the whole message could be complete already, but its
+	// sequence was needed by the fan-out of the first chunk
+	conn->msg_jseq = 0;
+}
+
+// handle v2 client hello if event (starting from its length byte) is hello
+// writes 6 bytes of the answer to reply and returns 1 if it was hello
+static char mined_hello(MINED *self, MINED_CONN *conn, const unsigned char *ev, size_t len, char *reply) {
+	uint32_t caps;
+	
+	if (len < MINE_HELLO_LEN - 1 || ev[0] != MINE_HELLO_LEN - 2 || memcmp(ev+1, MINE_PROTO_HELLO_MAGIC, 5) != 0) {
+		return 0;
+	}
+	
+	memcpy(&caps, ev+7, 4);
+	conn->version = ev[6] < MINE_PROTO_VERSION ? ev[6] : MINE_PROTO_VERSION;
+	conn->caps = ntohl(caps) & (MINED_CAPS | (self->jpath ? MINE_CAP_JOURNAL : 0));
+	DEBUG("PROTO_HELLO: %d, %u\n", ev[6], ntohl(caps));
+	
+	reply[0] = MINE_PROTO_HELLO;
+	reply[1] = MINE_PROTO_VERSION;
+	caps = htonl(MINED_CAPS | (self->jpath ? MINE_CAP_JOURNAL : 0));
+	memcpy(reply+2, &caps, 4);
+	
+	return 1;
+}
+
+// parse all complete frames from the read buffer
+// returns number of bytes consumed
+static size_t mined_parse(MINED *self, MINED_CONN *conn) {
+	unsigned char *buf = conn->rbuf;
+	size_t off = 0, avail;
+	
+	while (!conn->dead && (avail = conn->rlen - off) > 0) {
+		switch (conn->state) {
+			case MINE_PROTO_WAITING:
+				conn->state = buf[off++];
+				if (conn->state != MINE_PROTO_EVENT_REG &&
+				    conn->state != MINE_PROTO_EVENT_REG_MULTI &&
+				    conn->state != MINE_PROTO_EVENT_UNREG &&
+				    conn->state != MINE_PROTO_EVENT_REG_GROUP &&
+				    conn->state != MINE_PROTO_EVENT_REG_FLAGS &&
+				    conn->state != MINE_PROTO_EVENT_REG_FROM &&
+				    conn->state != MINE_PROTO_EVENT_RCV &&
+				    conn->state != MINE_PROTO_EVENT_DATA_RCV &&
+				    conn->state != MINE_PROTO_EVENT_DEF &&
+				    conn->state != MINE_PROTO_EVENT_ID_DATA_RCV &&
+				    conn->state != MINE_PROTO_DATA_RCV) {
+					DEBUG("unexpected protocol operation: %d\n", conn->state);
+					mined_conn_close(self, conn);
+				}
+				break;
+			
+			case MINE_PROTO_AUTH: {
+				unsigned char ulen, plen;
+				char password[256];
+				char status;
+				char reply[7];
+				
+				ulen = buf[off];
+				if (avail < (size_t)ulen + 2) {
+					return off;
+				}
+				plen = buf[off+ulen+1];
+				if (avail < (size_t)ulen + plen + 2) {
+					return off;
+				}
+				
+				memcpy(conn->user, buf+off+1, ulen);
+				conn->user[ulen] = '\0';
+				memcpy(password, buf+off+ulen+2, plen);
+				password[plen] = '\0';
+				off += ulen + plen + 2;
+				
+				if (mined_can_auth(self, conn->host, conn->user, password)) {
+					// v2 client sends hello together with login, answer it
+					// with status in one write, so client will get both at once
+					reply[0] = MINE_PROTO_AUTH_SUCCESS;
+					conn->state = MINE_PROTO_WAITING;
+					avail -= ulen + plen + 2;
+					if (avail > 0 && buf[off] == MINE_PROTO_EVENT_SND &&
+					    mined_hello(self, conn, buf+off+1, avail-1, reply+1)) {
+						off += MINE_HELLO_LEN;
+						mined_conn_send(self, conn, reply, 7);
+					}
+					else {
+						mined_conn_send(self, conn, reply, 1);
+					}
+				}
+				else {
+					status = MINE_PROTO_AUTH_FAIL;
+					mined_conn_send(self, conn, &status, 1);
+					mined_conn_flush(self, conn);
+					mined_conn_close(self, conn);
+				}
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_REG_MULTI: {
+				// count of registrations which follow without operation
+				int vlen = _mine_varint_get(buf+off, avail, &conn->regs_left);
+				
+				if (vlen == 0) {
+					return off;
+				}
+				if (vlen == -1) {
+					DEBUG("bad registrations count\n");
+					mined_conn_close(self, conn);
+					break;
+				}
+				
+				off += vlen;
+				DEBUG("PROTO_EVENT_REG_MULTI: %lu\n", (unsigned long)conn->regs_left);
+				conn->state = conn->regs_left > 0 ? MINE_PROTO_EVENT_REG : MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_REG:
+			case MINE_PROTO_EVENT_UNREG: {
+				unsigned char elen = buf[off];
+				char key[4+255];
+				
+				if (avail < (size_t)elen + 5) {
+					return off;
+				}
+				
+				// key is ip + event
+				memcpy(key, buf+off+1+elen, 4);
+				memcpy(key+4, buf+off+1, elen);
+				off += elen + 5;
+				
+				if (conn->state == MINE_PROTO_EVENT_UNREG) {
+					DEBUG("PROTO_EVENT_UNREG: %.*s, %u.%u.%u.%u\n", elen, key+4,
+						(unsigned char)key[0], (unsigned char)key[1], (unsigned char)key[2], (unsigned char)key[3]);
+					mined_unsubscribe(self, conn, key, elen+4, NULL, 0);
+					conn->state = MINE_PROTO_WAITING;
+					break;
+				}
+				
+				DEBUG("PROTO_EVENT_REG: %.*s, %u.%u.%u.%u\n", elen, key+4,
+					(unsigned char)key[0], (unsigned char)key[1], (unsigned char)key[2], (unsigned char)key[3]);
+				switch (mined_subscribe(self, conn, key, elen+4, NULL, 0, 0, 0)) {
+					case 0:
+						mined_warn("out of memory, dropping client");
+						mined_conn_close(self, conn);
+						break;
+					case 2:
+						if (self->nvalues) {
+							mined_replay(self, conn, key, elen);
+						}
+				}
+				
+				if (conn->regs_left > 0) {
+					conn->regs_left--;
+				}
+				conn->state = conn->regs_left > 0 ? MINE_PROTO_EVENT_REG : MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_REG_GROUP: {
+				// registration followed by flags and name of the queue group
+				unsigned char elen = buf[off], flags, glen;
+				char key[4+255];
+				
+				if (avail < (size_t)elen + 7) {
+					return off;
+				}
+				flags = buf[off+elen+5];
+				glen = buf[off+elen+6];
+				if (avail < (size_t)elen + glen + 7) {
+					return off;
+				}
+				
+				memcpy(key, buf+off+1+elen, 4);
+				memcpy(key+4, buf+off+1, elen);
+				DEBUG("PROTO_EVENT_REG_GROUP: %.*s, %u.%u.%u.%u, %.*s, %d\n", elen, key+4,
+					(unsigned char)key[0], (unsigned char)key[1], (unsigned char)key[2], (unsigned char)key[3],
+					glen, buf+off+elen+7, flags);
+				
+				if (flags & MINE_GROUP_LEAVE) {
+					mined_unsubscribe(self, conn, key, elen+4, (char *)buf+off+elen+7, glen);
+				}
+				else if (!mined_subscribe(self, conn, key, elen+4, (char *)buf+off+elen+7, glen, flags & MINE_GROUP_STICKY, 0)) {
+					mined_warn("out of memory, dropping client");
+					mined_conn_close(self, conn);
+				}
+				
+				off += elen + glen + 7;
+				conn->state = MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_REG_FLAGS: {
+				// registration followed by flags
+				unsigned char elen = buf[off], flags;
+				char key[4+255];
+				
+				if (avail < (size_t)elen + 6) {
+					return off;
+				}
+				
+				memcpy(key, buf+off+1+elen, 4);
+				memcpy(key+4, buf+off+1, elen);
+				flags = buf[off+elen+5];
+				off += elen + 6;
+				
+				DEBUG("PROTO_EVENT_REG_FLAGS: %.*s, %u.%u.%u.%u, %d\n", elen, key+4,
+					(unsigned char)key[0], (unsigned char)key[1], (unsigned char)key[2], (unsigned char)key[3], flags);
+				switch (mined_subscribe(self, conn, key, elen+4, NULL, 0, 0, flags & MINE_REG_CONFLATE)) {
+					case 0:
+						mined_warn("out of memory, dropping client");
+						mined_conn_close(self, conn);
+						break;
+					case 2:
+						if (self->nvalues) {
+							mined_replay(self, conn, key, elen);
+						}
+				}
+				
+				conn->state = MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_REG_FROM: {
+				// registration followed by journal sequence number
+				unsigned char elen = buf[off];
+				char key[4+255];
+				uint64_t seq;
+				int vlen;
+				
+				if (avail < (size_t)elen + 6) {
+					return off;
+				}
+				
+				vlen = _mine_varint_get(buf+off+elen+5, avail-elen-5, &seq);
+				if (vlen == 0) {
+					return off;
+				}
+				if (vlen == -1) {
+					DEBUG("bad journal sequence number\n");
+					mined_conn_close(self, conn);
+					break;
+				}
+				
+				memcpy(key, buf+off+1+elen, 4);
+				memcpy(key+4, buf+off+1, elen);
+				off += elen + 5 + vlen;
+				
+				DEBUG("PROTO_EVENT_REG_FROM: %.*s, %u.%u.%u.%u, %llu\n", elen, key+4,
+					(unsigned char)key[0], (unsigned char)key[1], (unsigned char)key[2], (unsigned char)key[3],
+					(unsigned long long)seq);
+				if (!mined_subscribe(self, conn, key, elen+4, NULL, 0, 0, 0)) {
+					mined_warn("out of memory, dropping client");
+					mined_conn_close(self, conn);
+				}
+				else {
+					mined_journal_from(self, conn, key, elen+4, seq);
+				}
+				
+				conn->state = MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_RCV: {
+				unsigned char elen = buf[off];
+				char reply[6];
+				
+				if (avail < (size_t)elen + 1) {
+					return off;
+				}
+				
+				conn->state = MINE_PROTO_WAITING;
+				if (mined_hello(self, conn, buf+off, avail, reply)) {
+					mined_conn_send(self, conn, reply, 6);
+					off += elen + 1;
+					break;
+				}
+				
+				memcpy(conn->event, buf+off+1, elen);
+				conn->elen = elen;
+				mined_route_by_name(conn);
+				off += elen + 1;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_DATA_RCV: {
+				// compact frame: event, varint data length and data
+				unsigned char elen = buf[off];
+				uint64_t datalen;
+				int vlen;
+				
+				if (avail < (size_t)elen + 2) {
+					return off;
+				}
+				
+				vlen = _mine_varint_get(buf+off+1+elen, avail-1-elen, &datalen);
+				if (vlen == 0) {
+					return off;
+				}
+				if (vlen == -1 || datalen > INT64_MAX) {
+					DEBUG("bad compact frame length\n");
+					mined_conn_close(self, conn);
+					break;
+				}
+				
+				memcpy(conn->event, buf+off+1, elen);
+				conn->elen = elen;
+				mined_route_by_name(conn);
+				conn->datalen = datalen;
+				off += elen + 1 + vlen;
+				
+				if (datalen == 0) {
+					conn->msg_seq = ++self->seq;
+					mined_resend_event(self, conn, NULL, 0, 1);
+					conn->state = MINE_PROTO_WAITING;
+					break;
+				}
+				
+				// data itself is received as usual
+				conn->first = 1;
+				conn->state = MINE_PROTO_DATA_RCV;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_DEF: {
+				// client defines id of the event name
+				uint64_t id;
+				unsigned char elen;
+				int vlen = _mine_varint_get(buf+off, avail, &id);
+				
+				if (vlen == 0) {
+					return off;
+				}
+				if (vlen == -1 || id >= MINE_PROTO_EVENT_IDS) {
+					DEBUG("bad event id\n");
+					mined_conn_close(self, conn);
+					break;
+				}
+				if (avail < (size_t)vlen + 1) {
+					return off;
+				}
+				elen = buf[off+vlen];
+				if (avail < (size_t)vlen + 1 + elen) {
+					return off;
+				}
+				
+				if (id >= conn->nroutes) {
+					size_t n = id < 64 ? 64 : id * 2;
+					MINED_ROUTE *routes = realloc(conn->routes, n * sizeof(MINED_ROUTE));
+					if (!routes) {
+						mined_warn("out of memory, dropping client");
+						mined_conn_close(self, conn);
+						break;
+					}
+					memset(routes + conn->nroutes, 0, (n - conn->nroutes) * sizeof(MINED_ROUTE));
+					if (conn->route != &conn->str_route) {
+						conn->route = routes + (conn->route - conn->routes);
+					}
+					conn->routes = routes;
+					conn->nroutes = n;
+				}
+				
+				DEBUG("PROTO_EVENT_DEF: %u, %.*s\n", (unsigned)id, elen, buf+off+vlen+1);
+				conn->routes[id].ev = mined_event_intern(self, (char *)buf+off+vlen+1, elen);
+				conn->routes[id].gen = 0;
+				if (!conn->routes[id].ev) {
+					mined_warn("out of memory, dropping client");
+					mined_conn_close(self, conn);
+					break;
+				}
+				if (conn->route == &conn->routes[id]) {
+					// current event redefined, but it remains current
+					mined_route_by_name(conn);
+				}
+				
+				off += vlen + 1 + elen;
+				conn->state = MINE_PROTO_WAITING;
+				break;
+			}
+			
+			case MINE_PROTO_EVENT_ID_DATA_RCV: {
+				// event id, varint data length and data
+				uint64_t id, datalen;
+				MINED_ROUTE *route;
+				int vlen = _mine_varint_get(buf+off, avail, &id);
+				int dlen = vlen > 0 ? _mine_varint_get(buf+off+vlen, avail-vlen, &datalen) : 0;
+				
+				if (dlen == 0 && vlen != -1) {
+					return off;
+				}
+				if (vlen == -1 || dlen == -1 || id >= conn->nroutes || !conn->routes[id].ev || datalen > INT64_MAX) {
+					DEBUG("bad event id frame\n");
+					mined_conn_close(self, conn);
+					break;
+				}
+				
+				route = &conn->routes[id];
+				if (conn->route != route) {
+					// name is still needed for shared memory readers
+					memcpy(conn->event, route->ev->name, route->ev->elen);
+					conn->elen = route->ev->elen;
+					conn->route = route;
+				}
+				conn->datalen = datalen;
+				off += vlen + dlen;
+				
+				if (datalen == 0) {
+					conn->msg_seq = ++self->seq;
+					mined_resend_event(self, conn, NULL, 0, 1);
+					conn->state = MINE_PROTO_WAITING;
+					break;
+				}
+				
+				conn->first = 1;
+				conn->state = MINE_PROTO_DATA_RCV;
+				break;
+			}
+			
+			case MINE_PROTO_DATA_RCV: {
+				size_t bytes;
+				char first = conn->first;
+				
+				if (conn->datalen == 0 && !first) {
+					// read data length first
+					if (avail < 8) {
+						return off;
+					}
+					
+					memcpy(&conn->datalen, buf+off, 8);
+					off += 8;
+					avail -= 8;
+					first = 1;
+				}
+				
+				if (first) {
+					conn->first = 0;
+					conn->msg_seq = ++self->seq;
+					
+					if (conn->datalen <= 0) {
+						conn->datalen = 0;
+						mined_resend_event(self, conn, NULL, 0, 1);
+						conn->state = MINE_PROTO_WAITING;
+						break;
+					}
+				}
+				
+				bytes = (uint64_t)conn->datalen < avail ? (size_t)conn->datalen : avail;
+				if (bytes == 0 && !first) {
+					return off;
+				}
+				
+				mined_resend_event(self, conn, (char *)buf+off, bytes, first);
+				off += bytes;
+				
+				if ((conn->datalen -= bytes) == 0) {
+					// all data received
+					conn->state = MINE_PROTO_WAITING;
+				}
+				break;
+			}
+			
+			default:
+				mined_conn_close(self, conn);
+		}
+	}
+	
+	return off;
+}
+
+static void mined_conn_read(MINED *self, MINED_CONN *conn) {
+	while (!conn->dead) {
+		ssize_t rv;
+		size_t off;
+		
+		if (conn->state == MINED_STATE_HANDSHAKE) {
+			ERR_clear_error();
+			rv = SSL_do_handshake(conn->ssl);
+			if (rv != 1) {
+				int err = SSL_get_error(conn->ssl, rv);
+				if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+					DEBUG("SSL handshake failed\n");
+					mined_conn_close(self, conn);
+				}
+				return;
+			}
+			
+			conn->state = MINE_PROTO_AUTH;
+		}
+		
+		if (conn->rlen == MINED_RBUF_SIZE) {
+			// should never happen, frames headers are smaller than buffer
+			mined_conn_close(self, conn);
+			return;
+		}
+		
+		if (conn->ssl) {
+			ERR_clear_error();
+			rv = SSL_read(conn->ssl, conn->rbuf + conn->rlen, MINED_RBUF_SIZE - conn->rlen);
+			if (rv <= 0) {
+				int err = SSL_get_error(conn->ssl, rv);
+				if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+					mined_conn_close(self, conn);
+				}
+				return;
+			}
+		}
+		else {
+			rv = recv(conn->fd, conn->rbuf + conn->rlen, MINED_RBUF_SIZE - conn->rlen, 0);
+			if (rv <= 0) {
+				if (rv == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+					mined_conn_close(self, conn);
+				}
+				return;
+			}
+		}
+		
+		conn->rlen += rv;
+		off = mined_parse(self, conn);
+		
+		// compact once per read
+		if (off < conn->rlen) {
+			memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+		}
+		conn->rlen -= off;
+	}
+}
+
+static void mined_accept(MINED *self, int lsock) {
+	while (1) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+		struct epoll_event ev;
+		MINED_CONN *conn;
+		char protocol;
+		int one = 1;
+		
+		int sock = accept4(lsock, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK);
+		if (sock == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+				mined_warn("accept: %s", strerror(errno));
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
+		
+		// unix socket client is on the same host and needs no encryption
+		char local = addr.ss_family == AF_UNIX;
+		if (!local) {
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		
+		conn = calloc(1, sizeof(MINED_CONN));
+		if (!conn) {
+			close(sock);
+			continue;
+		}
+		
+		conn->fd = sock;
+		conn->spill_fd = -1;
+		conn->jwfd = -1;
+		conn->jrfd = -1;
+		conn->id = ++self->seq;
+		conn->version = 1; // until client will say hello
+		conn->route = &conn->str_route;
+		conn->host = local ? INADDR_LOOPBACK : ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr);
+		
+		// write connection type directly and plain
+		protocol = self->ssl && !local ? MINE_PROTO_SSL : MINE_PROTO_PLAIN;
+		if (send(sock, &protocol, 1, MSG_NOSIGNAL) != 1) {
+			free(conn);
+			close(sock);
+			continue;
+		}
+		
+		if (protocol == MINE_PROTO_SSL) {
+			conn->ssl = SSL_new(self->ctx);
+			if (!conn->ssl) {
+				free(conn);
+				close(sock);
+				continue;
+			}
+			
+			SSL_set_fd(conn->ssl, sock);
+			SSL_set_accept_state(conn->ssl);
+			SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			conn->state = MINED_STATE_HANDSHAKE;
+		}
+		else {
+			conn->state = MINE_PROTO_AUTH;
+		}
+		
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			mined_warn("epoll_ctl: %s", strerror(errno));
+			if (conn->ssl) SSL_free(conn->ssl);
+			free(conn);
+			close(sock);
+			continue;
+		}
+		
+		conn->next = self->conns;
+		if (self->conns) {
+			self->conns->prev = conn;
+		}
+		self->conns = conn;
+		
+		DEBUG("accepted %d from %s\n", sock, local ? "unix socket" : inet_ntoa(((struct sockaddr_in *)&addr)->sin_addr));
+	}
+}
+
+static void mined_sigusr1(int sig) {
+	(void)sig;
+	MINED_DUMP = 1;
+}
+
+// prints output queues of the clients, requested by SIGUSR1
+static void mined_dump(MINED *self) {
+	MINED_CONN *conn;
+	
+	for (conn = self->conns; conn; conn = conn->next) {
+		struct in_addr addr;
+		
+		if (conn->dead) {
+			continue;
+		}
+		
+		addr.s_addr = htonl(conn->host);
+		mined_warn("%s@%s: depth=%llu peak=%llu dropped=%llu spilled=%llu conflated=%llu", conn->user, inet_ntoa(addr),
+		           (unsigned long long)mined_conn_depth(conn), (unsigned long long)conn->peak,
+		           (unsigned long long)conn->dropped, (unsigned long long)conn->spilled,
+		           (unsigned long long)conn->conflated);
+	}
+	
+	if (self->jpath) {
+		mined_warn("journal: next=%llu segments=%zu catching=%zu", (unsigned long long)self->jnext, self->njsegs, self->ncatching);
+	}
+}
+
+static int mined_listen_unix(MINED *self) {
+	struct sockaddr_un addr;
+	struct stat st;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(self->unix_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		goto MINED_LISTEN_UNIX_ERROR;
+	}
+	strcpy(addr.sun_path, self->unix_path);
+	
+	self->usock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (self->usock == -1) {
+		goto MINED_LISTEN_UNIX_ERROR;
+	}
+	
+	// socket file remains after previous run, other files are not ours
+	if (lstat(self->unix_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(self->unix_path);
+	}
+	if (bind(self->usock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		goto MINED_LISTEN_UNIX_ERROR;
+	}
+	
+	if (listen(self->usock, SOMAXCONN) == -1) {
+		goto MINED_LISTEN_UNIX_ERROR;
+	}
+	
+	return 1;
+	
+	MINED_LISTEN_UNIX_ERROR:
+		mined_warn("%s: %s", self->unix_path, strerror(errno));
+		return 0;
+}
+
+static int mined_listen(MINED *self) {
+	struct sockaddr_in addr;
+	int one = 1;
+	
+	self->lsock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (self->lsock == -1) {
+		goto MINED_LISTEN_ERROR;
+	}
+	
+	setsockopt(self->lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(self->bind_port);
+	if (!inet_aton(self->bind_address, &addr.sin_addr)) {
+		errno = EINVAL;
+		goto MINED_LISTEN_ERROR;
+	}
+	
+	if (bind(self->lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		goto MINED_LISTEN_ERROR;
+	}
+	
+	if (listen(self->lsock, SOMAXCONN) == -1) {
+		goto MINED_LISTEN_ERROR;
+	}
+	
+	return self->unix_path ? mined_listen_unix(self) : 1;
+	
+	MINED_LISTEN_ERROR:
+		mined_warn("%s:%d: %s", self->bind_address, self->bind_port, strerror(errno));
+		return 0;
+}
+
+static int mined_ssl_init(MINED *self, const char *certdir) {
+	char path[PATH_MAX];
+	
+	SSL_library_init();
+	SSL_load_error_strings();
+	MINE_SSL_LOADED = 1;
+	
+	self->ctx = SSL_CTX_new(SSLv23_server_method());
+	if (!self->ctx) {
+		goto MINED_SSL_ERROR;
+	}
+	
+	snprintf(path, sizeof(path), "%s/mine.crt", certdir);
+	if (SSL_CTX_use_certificate_chain_file(self->ctx, path) != 1) {
+		goto MINED_SSL_ERROR;
+	}
+	
+	snprintf(path, sizeof(path), "%s/mine.key", certdir);
+	if (SSL_CTX_use_PrivateKey_file(self->ctx, path, SSL_FILETYPE_PEM) != 1) {
+		goto MINED_SSL_ERROR;
+	}
+	
+	// reconnected clients resume sessions instead of full handshake
+	// tickets are encrypted by keys of this context and valid until restart
+	if (self->ssl_session_cache) {
+		SSL_CTX_set_session_id_context(self->ctx, (const unsigned char *)"mine", 4);
+		SSL_CTX_set_session_cache_mode(self->ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(self->ctx, self->ssl_session_cache);
+	}
+	else {
+		SSL_CTX_set_session_cache_mode(self->ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(self->ctx, SSL_OP_NO_TICKET);
+	}
+	
+	return 1;
+	
+	MINED_SSL_ERROR:
+		mined_warn("ssl: %s", ERR_error_string(ERR_get_error(), NULL));
+		return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *cfgdir = MINED_CONFIG_PATH;
+	const char *certdir = MINED_CERT_PATH;
+	struct epoll_event ev, events[MINED_MAX_EVENTS];
+	struct sigaction sa;
+	MINED self;
+	int opt, timeout = -1;
+	
+	while ((opt = getopt(argc, argv, "c:k:h")) != -1) {
+		switch (opt) {
+			case 'c':
+				cfgdir = optarg;
+				break;
+			case 'k':
+				certdir = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c config_dir] [-k cert_dir]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	
+	MINED_DEBUG = getenv("MINE_DEBUG") && *getenv("MINE_DEBUG");
+	signal(SIGPIPE, SIG_IGN);
+	
+	// without SA_RESTART, so epoll_wait will be interrupted
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = mined_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+	
+	memset(&self, 0, sizeof(self));
+	self.topics_gen = 1; // 0 is for invalid routes
+	mined_load_main(&self, cfgdir);
+	mined_load_users(&self, cfgdir);
+	mined_load_actions(cfgdir);
+	if (self.ipauth) {
+		// load hosts config if auth by ip allowed
+		mined_load_hosts(&self, cfgdir);
+	}
+	
+	if (self.ssl && !mined_ssl_init(&self, certdir)) {
+		return 1;
+	}
+	
+	if (!mined_listen(&self)) {
+		return 1;
+	}
+	
+	if (self.shm_path && !mined_shm_open(&self)) {
+		return 1;
+	}
+	
+	if (self.jpath && !mined_journal_open(&self)) {
+		return 1;
+	}
+	
+	self.epfd = epoll_create1(0);
+	if (self.epfd == -1) {
+		mined_warn("epoll_create1: %s", strerror(errno));
+		return 1;
+	}
+	
+	// listening sockets are marked by pointer to descriptor
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &self.lsock;
+	if (epoll_ctl(self.epfd, EPOLL_CTL_ADD, self.lsock, &ev) == -1) {
+		mined_warn("epoll_ctl: %s", strerror(errno));
+		return 1;
+	}
+	
+	ev.data.ptr = &self.usock;
+	if (self.unix_path && epoll_ctl(self.epfd, EPOLL_CTL_ADD, self.usock, &ev) == -1) {
+		mined_warn("epoll_ctl: %s", strerror(errno));
+		return 1;
+	}
+	
+	while (1) {
+		int n = epoll_wait(self.epfd, events, MINED_MAX_EVENTS, timeout);
+		int i;
+		
+		if (MINED_DUMP) {
+			MINED_DUMP = 0;
+			mined_dump(&self);
+		}
+		
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			mined_warn("epoll_wait: %s", strerror(errno));
+			return 1;
+		}
+		
+		for (i=0; i<n; i++) {
+			MINED_CONN *conn = events[i].data.ptr;
+			
+			if (events[i].data.ptr == &self.lsock || events[i].data.ptr == &self.usock) {
+				mined_accept(&self, *(int *)events[i].data.ptr);
+				continue;
+			}
+			
+			if (conn->dead) {
+				continue;
+			}
+			
+			if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+				mined_conn_flush(&self, conn);
+			}
+			
+			// ssl could want to write while reading and vice versa
+			if (conn->ssl || events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				mined_conn_read(&self, conn);
+			}
+			
+			if (!conn->dead && conn->ssl && conn->wlen) {
+				mined_conn_flush(&self, conn);
+			}
+		}
+		
+		while (self.dead) {
+			MINED_CONN *conn = self.dead;
+			self.dead = conn->next_dead;
+			mined_conn_free(&self, conn);
+		}
+		
+		if (self.shm) {
+			mined_shm_wake(&self);
+		}
+		
+		// journal is written once for all messages of the batch
+		timeout = mined_journal_tick(&self);
+	}
+	
+	return 0;
+}
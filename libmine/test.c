@@ -14,6 +14,14 @@ int main() {
 				
 				if (mine_event_send(m, "EV_SUX", 10, 10, "abcdefghij")) {
 					printf("Event successfully sent\n");
+					
+					MINE_MSG batch[] = {{"EV_SUX", "first", 5}, {"EV_COME", "second", 6}, {"EV_SUX", "third", 5}};
+					if (mine_event_send_batch(m, batch, 3)) {
+						printf("Batch successfully sent\n");
+					}
+					else {
+						printf("Error while sending batch: %s\n", m->errstr);
+					}
 				}
 				else {
 					printf("Error while sending event: %s\n", m->errstr);
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <poll.h>
+#include "mine.h"
+
+#define EVENTS_CNT 1000
+
+// wait until handle is ready for operation it wants
+int wait_for(MINE *m) {
+	struct pollfd pfd;
+	pfd.fd = mine_fd(m);
+	pfd.events = (mine_wants(m) & MINE_WANT_READ ? POLLIN : 0) | (mine_wants(m) & MINE_WANT_WRITE ? POLLOUT : 0);
+	
+	return poll(&pfd, 1, 5000) == 1;
+}
+
+int main() {
+	MINE *pub = mine_new();
+	MINE *sub = mine_new();
+	mine_set_nonblock(pub, 1);
+	mine_set_nonblock(sub, 1);
+	
+	MINE *m[] = {sub, pub};
+	int i;
+	for (i=0; i<2; i++) {
+		while (!mine_connect(m[i], "localhost", 1135)) {
+			if (m[i]->err != EAGAIN || !wait_for(m[i])) {
+				printf("Connection error: %s\n", m[i]->errstr);
+				return 1;
+			}
+		}
+		
+		while (!mine_login(m[i], "root", "123")) {
+			if (m[i]->err != EAGAIN || !wait_for(m[i])) {
+				printf("Login error: %s\n", m[i]->errstr);
+				return 1;
+			}
+		}
+	}
+	printf("Successfully connected and logged in. %s protocol\n", pub->ssl ? "SSL" : "Plain");
+	
+	if (!mine_event_reg(sub, "EV_NB", "0.0.0.0")) {
+		printf("Event registration error: %s\n", sub->errstr);
+		return 1;
+	}
+	while (!mine_flush(sub)) {
+		if (sub->err != EAGAIN || !wait_for(sub)) {
+			printf("Event registration error: %s\n", sub->errstr);
+			return 1;
+		}
+	}
+	// let server process registration before events will come
+	usleep(100000);
+	
+	char data[MINE_CHUNK_SIZE];
+	for (i=0; i<EVENTS_CNT; i++) {
+		int len = sprintf(data, "event %d", i);
+		if (!mine_event_send(pub, "EV_NB", len, len, data)) {
+			printf("Error while sending event: %s\n", pub->errstr);
+			return 1;
+		}
+	}
+	
+	int received = 0;
+	char *event;
+	int64_t datalen;
+	struct pollfd pfd[2];
+	while (received < EVENTS_CNT) {
+		for (i=0; i<2; i++) {
+			pfd[i].fd = mine_fd(m[i]);
+			pfd[i].events = (mine_wants(m[i]) & MINE_WANT_WRITE ? POLLOUT : 0) | (i == 0 ? POLLIN : 0);
+		}
+		
+		if (poll(pfd, 2, 5000) <= 0) {
+			printf("Timeout, %d events received\n", received);
+			return 1;
+		}
+		
+		if (pfd[1].revents & POLLOUT && !mine_flush(pub) && pub->err != EAGAIN) {
+			printf("Error while sending event: %s\n", pub->errstr);
+			return 1;
+		}
+		
+		if (pfd[0].revents & POLLIN) {
+			while (mine_event_recv_buf(sub, &event, &datalen, data, sizeof(data), MINE_RECV_WHOLE) != -1) {
+				received++;
+			}
+			
+			if (sub->err != EAGAIN) {
+				printf("Error while receiving event: %s\n", sub->errstr);
+				return 1;
+			}
+		}
+	}
+	printf("%d events successfully received\n", received);
+	
+	mine_destroy(pub);
+	mine_destroy(sub);
+	
+	return 0;
+}
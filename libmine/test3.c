@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include "mine.h"
+
+#define EVENTS_CNT 1000
+#define SHM_PATH "/dev/shm/mine"
+
+int main() {
+	MINE_SHM *shm = mine_shm_attach(SHM_PATH);
+	if (!shm) {
+		printf("Attach error: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	MINE *pub = mine_new();
+	if (!mine_connect(pub, "localhost", 1135) || !mine_login(pub, "root", "123")) {
+		printf("Connection error: %s\n", pub->errstr);
+		return 1;
+	}
+	printf("Successfully attached to %s and connected\n", SHM_PATH);
+	
+	// payload size grows, so frames will go round the ring
+	static char data[100000];
+	int i;
+	for (i=0; i<EVENTS_CNT; i++) {
+		int len = sprintf(data, "event %d", i);
+		if (!mine_event_send(pub, "EV_SHM", len + i*97, len + i*97, data)) {
+			printf("Error while sending event: %s\n", pub->errstr);
+			return 1;
+		}
+	}
+	
+	int received = 0;
+	char *event, *buf;
+	int64_t datalen;
+	char expected[32];
+	while (received < EVENTS_CNT) {
+		datalen = mine_shm_recv(shm, &event, &buf, 5000);
+		if (datalen == -1) {
+			printf("Error while receiving event: %s, %d events received\n", shm->errstr, received);
+			return 1;
+		}
+		if (strcmp(event, "EV_SHM") != 0) {
+			continue;
+		}
+		
+		int len = sprintf(expected, "event %d", received);
+		char match = datalen == len + received*97 && memcmp(buf, expected, len) == 0;
+		if (!mine_shm_valid(shm)) {
+			printf("Error while receiving event: %s, %d events received\n", shm->errstr, received);
+			return 1;
+		}
+		if (!match) {
+			printf("Unexpected event data: %.*s\n", len, buf);
+			return 1;
+		}
+		received++;
+	}
+	printf("%d events successfully received from shared memory\n", received);
+	
+	mine_destroy(pub);
+	mine_shm_detach(shm);
+	
+	return 0;
+}
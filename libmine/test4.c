@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "mine.h"
+
+#define EVENTS_CNT 10000
+
+// sends count events with numbers from start, each of them in one chunk
+int publish(MINE *pub, int pid, int start, int count) {
+	char data[MINE_CHUNK_SIZE];
+	int i;
+	
+	memset(data, 'x', sizeof(data));
+	for (i=start; i<start+count; i++) {
+		int len = sprintf(data, "%d %d", pid, i);
+		data[len] = ' ';
+		if (!mine_event_send(pub, "EV_JOURNAL", sizeof(data), sizeof(data), data)) {
+			return 0;
+		}
+	}
+	
+	return mine_flush(pub);
+}
+
+// mined should be started with journal_path in main.cfg
+int main() {
+	MINE *pub = mine_new();
+	MINE *sub = mine_new();
+	
+	MINE *m[] = {sub, pub};
+	int i;
+	for (i=0; i<2; i++) {
+		if (!mine_connect(m[i], "localhost", 1135) || !mine_login(m[i], "root", "123")) {
+			printf("Connection error: %s\n", m[i]->errstr);
+			return 1;
+		}
+	}
+	printf("Successfully connected and logged in. %s protocol\n", pub->ssl ? "SSL" : "Plain");
+	
+	// messages of this run are told apart by pid, journal could keep older ones
+	int pid = getpid();
+	if (!publish(pub, pid, 0, EVENTS_CNT)) {
+		printf("Error while sending event: %s\n", pub->errstr);
+		return 1;
+	}
+	
+	if (!mine_event_reg_from(sub, "EV_JOURNAL", "0.0.0.0", 0)) {
+		printf("Event registration error: %s\n", sub->errstr);
+		return 1;
+	}
+	// let server process registration before events will come
+	usleep(100000);
+	
+	// more than socket buffers hold was journaled, so subscriber which does
+	// not read yet is still catching up while the same count is published
+	if (!publish(pub, pid, EVENTS_CNT, EVENTS_CNT)) {
+		printf("Error while sending event: %s\n", pub->errstr);
+		return 1;
+	}
+	
+	int received = 0;
+	uint64_t last_seq = 0;
+	char buf[MINE_CHUNK_SIZE+1];
+	char *event;
+	int64_t datalen, rv;
+	while (received < EVENTS_CNT*2) {
+		rv = mine_event_recv_buf(sub, &event, &datalen, buf, sizeof(buf)-1, MINE_RECV_WHOLE);
+		if (rv == -1) {
+			printf("Error while receiving event: %s, %d events received\n", sub->errstr, received);
+			return 1;
+		}
+		
+		// each message has sequence, which grows
+		if (sub->rcv_seq <= last_seq) {
+			printf("Sequence %llu after %llu\n", (unsigned long long)sub->rcv_seq, (unsigned long long)last_seq);
+			return 1;
+		}
+		last_seq = sub->rcv_seq;
+		
+		int r_pid, r_i;
+		buf[rv] = '\0';
+		if (sscanf(buf, "%d %d", &r_pid, &r_i) != 2 || r_pid != pid) {
+			continue;
+		}
+		if (r_i != received) {
+			printf("Unexpected event %d, %d events received\n", r_i, received);
+			return 1;
+		}
+		received++;
+	}
+	printf("%d events successfully received in order, last sequence %llu\n", received, (unsigned long long)last_seq);
+	
+	mine_destroy(pub);
+	mine_destroy(sub);
+	
+	return 0;
+}
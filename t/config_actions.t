@@ -312,6 +312,52 @@ is_deeply(
 	'Optimized config deep comprasion'
 );
 
+# match() tests
+$json = <<JSON;
+	[
+		{
+			"sender": ["10.1.0.0/20", "192.168.0.1"],
+			"event": ["MAMBA"],
+			"action": [ { "A::a": null } ]
+		},
+		{
+			"action": [ { "C::c": null } ]
+		},
+		{
+			"user": ["oleg"],
+			"event": ["MAMBA", "NUMBA"],
+			"action": [ { "D::d": 5 } ]
+		}
+	]
+JSON
+$cfg = Mine::Config::Actions->new(\$json);
+$cfg->load_optimized();
+is_deeply(
+	[ map { keys %{$_->[0]} } @{$cfg->match(167837697, 'oleg', 'MAMBA')} ],
+	[ 'A::a', 'D::d', 'C::c' ],
+	'match() all conditions matched'
+);
+is_deeply(
+	[ map { keys %{$_->[0]} } @{$cfg->match(3232235521, 'root', 'MAMBA')} ],
+	[ 'A::a', 'C::c' ],
+	'match() sender and event matched'
+);
+is_deeply(
+	[ map { keys %{$_->[0]} } @{$cfg->match(3232235522, 'oleg', 'MAMBA')} ],
+	[ 'D::d', 'C::c' ],
+	'match() sender not matched'
+);
+is_deeply(
+	[ map { keys %{$_->[0]} } @{$cfg->match(167837697, 'root', 'NUMBA')} ],
+	[ 'C::c' ],
+	'match() only actions without conditions'
+);
+is(
+	$cfg->match(167837697, 'oleg', 'MAMBA'),
+	$cfg->match(167837697, 'oleg', 'MAMBA'),
+	'match() result cached'
+);
+
 # saving test
 ok(
 	eval {
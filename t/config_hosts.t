@@ -45,6 +45,13 @@ is_deeply(
 	"Optimized config deep comrasion: $json"
 );
 
+# allowed
+$cfg = Mine::Config::Hosts->new(\$json);
+$cfg->load_optimized();
+ok($cfg->allowed(167772161), 'allowed() host');
+ok($cfg->allowed(168431615), 'allowed() network');
+ok(!$cfg->allowed(168431616), 'allowed() out of network');
+
 # saving invalid data config
 like(
 	eval {
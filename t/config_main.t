@@ -39,7 +39,19 @@ $json = <<JSON;
 	"bind_port": 90,
 	"bind_address": "192.168.0.1",
 	"ssl": false,
-	"ipauth": true
+	"ssl_session_cache": 100,
+	"ipauth": true,
+	"unix_path": "/tmp/mine.sock",
+	"out_queue_limit": 1048576,
+	"out_queue_policy": "drop_oldest",
+	"spill_path": "/var/tmp",
+	"last_value_events": ["EV_STATE", "EV_PRICE"],
+	"last_value_size": 4096,
+	"last_value_limit": 1048576,
+	"journal_path": "/var/lib/mine",
+	"journal_segment_size": 67108864,
+	"journal_segments": 16,
+	"journal_sync": 100
 }
 JSON
 ok(eval{Mine::Config::Main->new(\$json)}, "Complete correct config: $json")
@@ -48,6 +60,36 @@ ok(eval{Mine::Config::Main->new(\$json)}, "Complete correct config: $json")
 $json = '{"ssl":"bool", "bind_port":30}';
 like(eval{Mine::Config::Main->new(\$json)}||$@, qr/true or false/, "Not boolean `ssl' value: $json")
 	or diag $@;
+$json = '{"ssl_session_cache":-1, "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/numeric/, "Negative `ssl_session_cache': $json")
+	or diag $@;
+$json = '{"unix_path":["/tmp/mine.sock"], "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/string/, "Not string `unix_path': $json")
+	or diag $@;
+$json = '{"out_queue_limit":"64M", "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/numeric/, "Not numeric `out_queue_limit': $json")
+	or diag $@;
+$json = '{"out_queue_policy":"block", "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/spill/, "Unknown `out_queue_policy': $json")
+	or diag $@;
+$json = '{"spill_path":null, "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/string/, "Not string `spill_path': $json")
+	or diag $@;
+$json = '{"last_value_events":"EV_STATE", "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/array/, "Not array `last_value_events': $json")
+	or diag $@;
+$json = '{"last_value_events":["EV_STATE", null], "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/event names/, "Not event name in `last_value_events': $json")
+	or diag $@;
+$json = '{"last_value_limit":-1, "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/numeric/, "Negative `last_value_limit': $json")
+	or diag $@;
+$json = '{"journal_path":false, "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/string/, "Not string `journal_path': $json")
+	or diag $@;
+$json = '{"journal_sync":"1s", "bind_port":30}';
+like(eval{Mine::Config::Main->new(\$json)}||$@, qr/numeric/, "Not numeric `journal_sync': $json")
+	or diag $@;
 
 # saving invalid data config
 like(
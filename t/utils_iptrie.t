@@ -0,0 +1,34 @@
+#!/usr/bin/env perl
+
+use Test::More;
+BEGIN {
+	use_ok('Mine::Utils::IPTrie');
+}
+use Mine::Utils::IP qw(cidr2long host2long);
+use strict;
+
+my $trie = Mine::Utils::IPTrie->new();
+isa_ok($trie, 'Mine::Utils::IPTrie');
+is($trie->lookup(host2long('10.0.0.1')), undef, 'Lookup in empty trie');
+
+$trie->add(host2long('10.0.0.0'), cidr2long(8), 'ten');
+$trie->add(host2long('10.1.0.0'), cidr2long(16), 'ten-one');
+$trie->add(host2long('10.1.2.3'), cidr2long(32), 'host');
+$trie->add(host2long('10.1.0.0'), cidr2long(16), 'ten-one-again');
+is($trie->size, 4, 'size()');
+
+is($trie->lookup(host2long('10.2.3.4')), 'ten', 'Lookup /8');
+is($trie->lookup(host2long('10.1.200.4')), 'ten-one', 'Lookup longest prefix');
+is($trie->lookup(host2long('10.1.2.3')), 'host', 'Lookup /32');
+is($trie->lookup(host2long('11.1.2.3')), undef, 'Lookup not found');
+is_deeply(
+	[ $trie->lookup_all(host2long('10.1.2.3')) ],
+	[ 'ten', 'ten-one', 'ten-one-again', 'host' ],
+	'lookup_all()'
+);
+
+$trie->add(0, 0, 'any');
+is($trie->lookup(host2long('192.168.0.1')), 'any', 'Lookup /0');
+is($trie->lookup(host2long('255.255.255.255')), 'any', 'Lookup broadcast');
+
+done_testing();